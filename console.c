@@ -1,9 +1,11 @@
 /* Implementation of simple command-line interface */
 
 #include <ctype.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -12,6 +14,8 @@
 #include <unistd.h>
 
 #include "console.h"
+#include "cpucycles.h"
+#include "perf.h"
 #include "report.h"
 #include "web.h"
 
@@ -20,6 +24,12 @@ int simulation = 0;
 int show_entropy = 0;
 static cmd_element_t *cmd_list = NULL;
 static param_element_t *param_list = NULL;
+
+/* Hash tables indexing the command and parameter lists by name */
+#define HASH_BITS 7
+#define HASH_SIZE (1 << HASH_BITS)
+static cmd_element_t *cmd_table[HASH_SIZE];
+static param_element_t *param_table[HASH_SIZE];
 static bool block_flag = false;
 static bool prompt_flag = true;
 
@@ -65,6 +75,9 @@ static bool has_infile = false;
 static cmd_func_t quit_helpers[MAXQUIT];
 static int quit_helper_cnt = 0;
 
+/* Optional function to save and restore state between benchmark runs */
+static state_func_t state_helper = NULL;
+
 static void init_in();
 
 static bool push_file(char *fname);
@@ -72,6 +85,33 @@ static void pop_file();
 
 static bool interpret_cmda(int argc, char *argv[]);
 
+/* FNV-1a hash of a name, folded to a table index */
+static inline unsigned int hash_name(const char *name)
+{
+    uint32_t h = 2166136261u;
+    while (*name) {
+        h ^= (unsigned char) *name++;
+        h *= 16777619u;
+    }
+    return (h ^ (h >> HASH_BITS)) & (HASH_SIZE - 1);
+}
+
+static cmd_element_t *find_cmd(const char *name)
+{
+    cmd_element_t *cmd = cmd_table[hash_name(name)];
+    while (cmd && strcmp(name, cmd->name) != 0)
+        cmd = cmd->hash_next;
+    return cmd;
+}
+
+static param_element_t *find_param(const char *name)
+{
+    param_element_t *param = param_table[hash_name(name)];
+    while (param && strcmp(name, param->name) != 0)
+        param = param->hash_next;
+    return param;
+}
+
 /* Add a new command */
 void add_cmd(char *name, cmd_func_t operation, char *summary, char *param)
 {
@@ -89,6 +129,10 @@ void add_cmd(char *name, cmd_func_t operation, char *summary, char *param)
     cmd->param = param;
     cmd->next = next_cmd;
     *last_loc = cmd;
+
+    unsigned int h = hash_name(name);
+    cmd->hash_next = cmd_table[h];
+    cmd_table[h] = cmd;
 }
 
 /* Add a new parameter */
@@ -109,6 +153,10 @@ void add_param(char *name, int *valp, char *summary, setter_func_t setter)
     param->setter = setter;
     param->next = next_param;
     *last_loc = param;
+
+    unsigned int h = hash_name(name);
+    param->hash_next = param_table[h];
+    param_table[h] = param;
 }
 
 /* Parse a string into a command line */
@@ -144,6 +192,7 @@ static char **parse_args(char *line, int *argcp)
             *dst++ = c;
         }
     }
+    *dst = '\0';
 
     /* Now assemble into array of strings */
     char **argv = calloc_or_fail(argc, sizeof(char *), "parse_args");
@@ -167,16 +216,119 @@ static void record_error()
     }
 }
 
-/* Execute a command that has already been split into arguments */
-static bool interpret_cmda(int argc, char *argv[])
+/* Variables, set with 'set' and referenced as $name in any argument */
+#define MAXVARS 32
+#define MAXARGS 64
+
+typedef struct {
+    char *name;
+    char *value;
+} var_t;
+
+static var_t vars[MAXVARS];
+static int var_cnt = 0;
+
+static var_t *find_var(const char *name, size_t len)
 {
-    if (argc == 0)
-        return true;
-    /* Try to find matching command */
-    cmd_element_t *next_cmd = cmd_list;
+    for (int i = 0; i < var_cnt; i++) {
+        if (strncmp(vars[i].name, name, len) == 0 && vars[i].name[len] == '\0')
+            return &vars[i];
+    }
+    return NULL;
+}
+
+static bool set_var(char *name, char *value)
+{
+    var_t *var = find_var(name, strlen(name));
+    if (!var) {
+        if (var_cnt == MAXVARS) {
+            report(1, "Too many variables");
+            return false;
+        }
+        var = &vars[var_cnt++];
+        var->name = strsave_or_fail(name, "set_var");
+    } else {
+        free_string(var->value);
+    }
+    var->value = strsave_or_fail(value, "set_var");
+    return true;
+}
+
+static void free_vars()
+{
+    for (int i = 0; i < var_cnt; i++) {
+        free_string(vars[i].name);
+        free_string(vars[i].value);
+    }
+    var_cnt = 0;
+}
+
+static inline bool is_var_char(char c)
+{
+    return isalnum((unsigned char) c) || c == '_';
+}
+
+/* Substitute the values of variables referenced in argv.
+ * Returns argv itself when there is nothing to substitute, otherwise a
+ * static vector that stays valid until the next call.  References to
+ * undefined variables are left as they are.
+ */
+static char **expand_vars(int argc, char *argv[])
+{
+    static char *xargv[MAXARGS];
+    static char xbuf[RIO_BUFSIZE];
+
+    if (var_cnt == 0 || argc > MAXARGS)
+        return argv;
+
+    int i;
+    for (i = 0; i < argc && !strchr(argv[i], '$'); i++)
+        ;
+    if (i == argc)
+        return argv;
+
+    char *dst = xbuf;
+    char *end = xbuf + sizeof(xbuf) - 1;
+    for (i = 0; i < argc; i++) {
+        xargv[i] = dst;
+        char *src = argv[i];
+        while (*src && dst < end) {
+            if (*src != '$') {
+                *dst++ = *src++;
+                continue;
+            }
+            size_t len = 0;
+            while (is_var_char(src[len + 1]))
+                len++;
+            var_t *var = len ? find_var(src + 1, len) : NULL;
+            if (!var) {
+                *dst++ = *src++;
+                continue;
+            }
+            for (char *v = var->value; *v && dst < end;)
+                *dst++ = *v++;
+            src += len + 1;
+        }
+        *dst = '\0';
+        if (dst < end)
+            dst++;
+    }
+    return xargv;
+}
+
+/* Nesting level of commands run through interpret_cmda, e.g. by 'time' */
+static int cmd_depth = 0;
+
+/* Execute a command whose entry has already been looked up.
+ * next_cmd is NULL if argv[0] does not name a command.
+ */
+static bool run_cmd(cmd_element_t *next_cmd, int argc, char *argv[])
+{
+    bool top = cmd_depth++ == 0;
+    if (top)
+        json_cmd_begin();
+
     bool ok = true;
-    while (next_cmd && strcmp(argv[0], next_cmd->name) != 0)
-        next_cmd = next_cmd->next;
     if (next_cmd) {
         ok = next_cmd->operation(argc, argv);
         if (!ok)
@@ -187,25 +339,326 @@ static bool interpret_cmda(int argc, char *argv[])
         ok = false;
     }
 
+    if (top)
+        json_cmd_end(argc, argv, ok);
+    cmd_depth--;
     return ok;
 }
 
+/* Execute a command that has already been split into arguments */
+static bool interpret_cmda(int argc, char *argv[])
+{
+    if (argc == 0)
+        return true;
+
+    /* Try to find matching command */
+    return run_cmd(find_cmd(argv[0]), argc, argv);
+}
+
+/* Lines of a 'repeat' block typed or read interactively are collected here
+ * until the block is closed, then compiled and run as a whole.
+ */
+static struct {
+    char *text;
+    size_t len;
+    size_t size;
+    int depth; /* Number of open blocks; 0 when not collecting */
+} pending = {NULL, 0, 0, 0};
+
+static bool collect_line(char *line);
+
 /* Execute a command from a command line */
 static bool interpret_cmd(char *cmdline)
 {
     if (quit_flag)
         return false;
 
+    if (pending.depth)
+        return collect_line(cmdline);
+
     int argc;
     char **argv = parse_args(cmdline, &argc);
-    bool ok = interpret_cmda(argc, argv);
+    bool ok = interpret_cmda(argc, expand_vars(argc, argv));
     for (int i = 0; i < argc; i++)
         free_string(argv[i]);
     free_array(argv, argc, sizeof(char *));
+    report_flush();
 
     return ok;
 }
 
+/* Compiled command files.
+ * With option 'compile' set, 'source' reads the whole file at once, splits
+ * it in place into words and resolves every command up front.  The
+ * resulting instruction array is then run in a tight loop, with no
+ * tokenizing, lookup or allocation per line.
+ *
+ * A block "repeat n {" ... "}" compiles into a pair of instructions that
+ * jump to each other, so its body is run n times without being parsed
+ * again.  Blocks may be nested up to MAXNEST deep.
+ */
+static int compile_mode = 0;
+
+#define MAXNEST 16
+
+typedef enum { OP_CMD, OP_REPEAT, OP_END } op_t;
+
+typedef struct {
+    op_t op;
+    cmd_element_t *cmd; /* NULL for unknown command */
+    int argc;
+    char **argv;
+    size_t jump; /* OP_REPEAT: past matching OP_END, OP_END: to OP_REPEAT */
+} instr_t;
+
+typedef struct {
+    char *text;  /* File contents, split into words */
+    size_t text_size;
+    char **args; /* Argument vectors of all instructions */
+    size_t nargs;
+    instr_t *code;
+    size_t ninstrs;
+} program_t;
+
+/* Read a whole file into a null-terminated buffer */
+static char *load_file(char *fname, size_t *sizep)
+{
+    int fd = open(fname, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return NULL;
+    }
+
+    size_t size = st.st_size;
+    char *text = malloc_or_fail(size + 1, "load_file");
+    size_t got = 0;
+    while (got < size) {
+        ssize_t n = read(fd, text + got, size - got);
+        if (n <= 0)
+            break;
+        got += n;
+    }
+    close(fd);
+    text[got] = '\0';
+    *sizep = size + 1;
+    return text;
+}
+
+/* Count lines holding at least one word, and words */
+static void count_words(char *text, size_t *nlines, size_t *nwords)
+{
+    bool skipping = true, empty = true;
+    *nlines = *nwords = 0;
+    for (char *p = text; *p; p++) {
+        if (*p == '\n') {
+            skipping = empty = true;
+        } else if (isspace((unsigned char) *p)) {
+            skipping = true;
+        } else if (skipping) {
+            skipping = false;
+            (*nwords)++;
+            if (empty)
+                (*nlines)++;
+            empty = false;
+        }
+    }
+}
+
+static void free_program(program_t *prog)
+{
+    free_array(prog->code, prog->ninstrs + 1, sizeof(instr_t));
+    free_array(prog->args, prog->nargs + 1, sizeof(char *));
+    free_block(prog->text, prog->text_size);
+}
+
+/* Compile the text already loaded into prog.
+ * On a syntax error, reports it, frees prog and returns false.
+ */
+static bool compile_text(program_t *prog)
+{
+    count_words(prog->text, &prog->ninstrs, &prog->nargs);
+    prog->code = calloc_or_fail(prog->ninstrs + 1, sizeof(instr_t),
+                                "compile_text");
+    prog->args =
+        calloc_or_fail(prog->nargs + 1, sizeof(char *), "compile_text");
+
+    instr_t *in = NULL;
+    char **arg = prog->args;
+    bool line_start = true;
+    for (char *p = prog->text; *p;) {
+        if (*p == '\n') {
+            *p++ = '\0';
+            line_start = true;
+            continue;
+        }
+        if (isspace((unsigned char) *p)) {
+            *p++ = '\0';
+            continue;
+        }
+
+        /* Start of a word */
+        if (line_start) {
+            in = in ? in + 1 : prog->code;
+            in->argv = arg;
+            in->argc = 0;
+            line_start = false;
+        }
+        *arg++ = p;
+        in->argc++;
+        while (*p && !isspace((unsigned char) *p))
+            p++;
+    }
+
+    size_t open_blocks[MAXNEST];
+    int depth = 0;
+    for (size_t i = 0; i < prog->ninstrs; i++) {
+        in = &prog->code[i];
+        if (strcmp(in->argv[0], "repeat") == 0) {
+            if (in->argc != 3 || strcmp(in->argv[2], "{") != 0) {
+                report(1, "Line %zu: expected 'repeat n {'", i + 1);
+                goto error;
+            }
+            if (depth == MAXNEST) {
+                report(1, "Line %zu: blocks nested too deeply", i + 1);
+                goto error;
+            }
+            in->op = OP_REPEAT;
+            open_blocks[depth++] = i;
+        } else if (strcmp(in->argv[0], "}") == 0) {
+            if (in->argc != 1 || depth == 0) {
+                report(1, "Line %zu: unmatched '}'", i + 1);
+                goto error;
+            }
+            in->op = OP_END;
+            in->jump = open_blocks[--depth];
+            prog->code[in->jump].jump = i + 1;
+        } else {
+            in->op = OP_CMD;
+            in->cmd = find_cmd(in->argv[0]);
+        }
+    }
+    if (depth == 0)
+        return true;
+    report(1, "Missing '}' at end of input");
+
+error:
+    free_program(prog);
+    return false;
+}
+
+static bool compile_file(char *fname, program_t *prog)
+{
+    memset(prog, 0, sizeof(program_t));
+    prog->text = load_file(fname, &prog->text_size);
+    if (!prog->text) {
+        report(1, "Could not open source file '%s'", fname);
+        return false;
+    }
+    return compile_text(prog);
+}
+
+static void echo_instr(instr_t *in)
+{
+    if (!echo)
+        return;
+    report_noreturn(1, prompt);
+    for (int i = 0; i < in->argc - 1; i++)
+        report_noreturn(1, "%s ", in->argv[i]);
+    report(1, "%s", in->argv[in->argc - 1]);
+}
+
+/* Run a compiled program.  Instructions are echoed as they execute unless
+ * show is false, as for blocks whose lines were echoed when read.
+ */
+static void run_program(program_t *prog, bool show)
+{
+    int left[MAXNEST]; /* Iterations left in each open block */
+    int depth = 0;
+    size_t pc = 0;
+    while (pc < prog->ninstrs && !quit_flag) {
+        instr_t *in = &prog->code[pc];
+        if (show && in->op != OP_END)
+            echo_instr(in);
+
+        if (in->op == OP_REPEAT) {
+            char **argv = expand_vars(in->argc, in->argv);
+            int cnt;
+            if (!get_int(argv[1], &cnt)) {
+                report(1, "Invalid repeat count '%s'", argv[1]);
+                record_error();
+                cnt = 0;
+            }
+            if (cnt > 0) {
+                left[depth++] = cnt;
+                pc++;
+            } else {
+                pc = in->jump;
+            }
+        } else if (in->op == OP_END) {
+            if (--left[depth - 1] > 0) {
+                pc = in->jump + 1;
+            } else {
+                depth--;
+                pc++;
+            }
+        } else {
+            run_cmd(in->cmd, in->argc, expand_vars(in->argc, in->argv));
+            report_flush();
+            pc++;
+        }
+    }
+}
+
+/* Add a line to the pending block, and run the block once it is closed */
+static bool collect_line(char *line)
+{
+    int argc;
+    char **argv = parse_args(line, &argc);
+    if (argc == 1 && strcmp(argv[0], "}") == 0)
+        pending.depth--;
+    else if (argc == 3 && strcmp(argv[0], "repeat") == 0 &&
+             strcmp(argv[2], "{") == 0)
+        pending.depth++;
+    for (int i = 0; i < argc; i++)
+        free_string(argv[i]);
+    free_array(argv, argc, sizeof(char *));
+
+    size_t len = strlen(line);
+    if (pending.len + len + 2 > pending.size) {
+        size_t size = 2 * (pending.len + len + 2);
+        char *text = malloc_or_fail(size, "collect_line");
+        if (pending.text) {
+            memcpy(text, pending.text, pending.len);
+            free_block(pending.text, pending.size);
+        }
+        pending.text = text;
+        pending.size = size;
+    }
+    memcpy(pending.text + pending.len, line, len);
+    pending.len += len;
+    pending.text[pending.len++] = '\n';
+    pending.text[pending.len] = '\0';
+
+    if (pending.depth)
+        return true;
+
+    program_t prog = {
+        .text = pending.text,
+        .text_size = pending.size,
+    };
+    pending.text = NULL;
+    pending.len = pending.size = 0;
+    if (!compile_text(&prog))
+        return false;
+    run_program(&prog, false);
+    free_program(&prog);
+    return true;
+}
+
 /* Set function to be executed as part of program exit */
 void add_quit_helper(cmd_func_t qf)
 {
@@ -215,6 +668,12 @@ void add_quit_helper(cmd_func_t qf)
         report_event(MSG_FATAL, "Exceeded limit on quit helpers");
 }
 
+/* Set function that saves and restores state between benchmark runs */
+void set_state_helper(state_func_t sf)
+{
+    state_helper = sf;
+}
+
 /* Turn echoing on/off */
 void set_echo(bool on)
 {
@@ -238,6 +697,12 @@ static bool do_quit(int argc, char *argv[])
         p = p->next;
         free_block(ele, sizeof(param_element_t));
     }
+    memset(cmd_table, 0, sizeof(cmd_table));
+    memset(param_table, 0, sizeof(param_table));
+    free_vars();
+    if (pending.text)
+        free_block(pending.text, pending.size);
+    memset(&pending, 0, sizeof(pending));
 
     while (buf_stack)
         pop_file();
@@ -311,7 +776,6 @@ static bool do_option(int argc, char *argv[])
     for (int i = 1; i < argc; i++) {
         char *name = argv[i];
         int value = 0;
-        bool found = false;
         /* Get value from next argument */
         if (i + 1 >= argc) {
             report(1, "No value given for parameter %s", name);
@@ -320,23 +784,16 @@ static bool do_option(int argc, char *argv[])
             report(1, "Cannot parse '%s' as integer", argv[i]);
             return false;
         }
-        /* Find parameter in list */
-        param_element_t *plist = param_list;
-        while (!found && plist) {
-            if (strcmp(plist->name, name) == 0) {
-                int oldval = *plist->valp;
-                *plist->valp = value;
-                if (plist->setter)
-                    plist->setter(oldval);
-                found = true;
-            } else
-                plist = plist->next;
-        }
-        /* Didn't find parameter */
-        if (!found) {
+        /* Find parameter in table */
+        param_element_t *param = find_param(name);
+        if (!param) {
             report(1, "Unknown parameter '%s'", name);
             return false;
         }
+        int oldval = *param->valp;
+        *param->valp = value;
+        if (param->setter)
+            param->setter(oldval);
     }
 
     return true;
@@ -349,6 +806,15 @@ static bool do_source(int argc, char *argv[])
         return false;
     }
 
+    if (compile_mode) {
+        program_t prog;
+        if (!compile_file(argv[1], &prog))
+            return false;
+        run_program(&prog, true);
+        free_program(&prog);
+        return true;
+    }
+
     if (!push_file(argv[1])) {
         report(1, "Could not open source file '%s'", argv[1]);
         return false;
@@ -371,6 +837,106 @@ static bool do_log(int argc, char *argv[])
     return result;
 }
 
+static bool do_json(int argc, char *argv[])
+{
+    if (argc < 2) {
+        report(1, "No JSON file given");
+        return false;
+    }
+
+    bool result = set_jsonfile(argv[1]);
+    if (!result)
+        report(1, "Couldn't open JSON file '%s'", argv[1]);
+
+    return result;
+}
+
+static bool do_repeat(int argc, char *argv[])
+{
+    if (argc != 3 || strcmp(argv[2], "{") != 0) {
+        report(1, "Usage: repeat n {");
+        return false;
+    }
+
+    int cnt;
+    if (!get_int(argv[1], &cnt)) {
+        report(1, "Invalid repeat count '%s'", argv[1]);
+        return false;
+    }
+
+    if (cmd_depth > 1) {
+        report(1, "A repeat block cannot be run by another command");
+        return false;
+    }
+
+    /* Following lines are collected up to the matching '}' */
+    char header[32];
+    snprintf(header, sizeof(header), "repeat %d {", cnt);
+    return collect_line(header);
+}
+
+static bool valid_var_name(char *name)
+{
+    if (!*name)
+        return false;
+    for (; *name; name++) {
+        if (!is_var_char(*name))
+            return false;
+    }
+    return true;
+}
+
+static bool do_set(int argc, char *argv[])
+{
+    if (argc == 1) {
+        for (int i = 0; i < var_cnt; i++)
+            report(1, "  %-12s%s", vars[i].name, vars[i].value);
+        return true;
+    }
+
+    if (argc != 3) {
+        report(1, "Usage: set name value");
+        return false;
+    }
+
+    if (!valid_var_name(argv[1])) {
+        report(1, "Invalid variable name '%s'", argv[1]);
+        return false;
+    }
+
+    return set_var(argv[1], argv[2]);
+}
+
+static bool do_inc(int argc, char *argv[])
+{
+    if (argc != 2 && argc != 3) {
+        report(1, "Usage: inc name [delta]");
+        return false;
+    }
+
+    int delta = 1;
+    if (argc == 3 && !get_int(argv[2], &delta)) {
+        report(1, "Invalid increment '%s'", argv[2]);
+        return false;
+    }
+
+    if (!valid_var_name(argv[1])) {
+        report(1, "Invalid variable name '%s'", argv[1]);
+        return false;
+    }
+
+    int value = 0;
+    var_t *var = find_var(argv[1], strlen(argv[1]));
+    if (var && !get_int(var->value, &value)) {
+        report(1, "Variable '%s' is not an integer", argv[1]);
+        return false;
+    }
+
+    char buf[16];
+    snprintf(buf, sizeof(buf), "%d", value + delta);
+    return set_var(argv[1], buf);
+}
+
 static bool do_time(int argc, char *argv[])
 {
     double delta = delta_time(&last_time);
@@ -391,9 +957,123 @@ static bool do_time(int argc, char *argv[])
     return ok;
 }
 
+static int cmp_int64(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *) a, y = *(const int64_t *) b;
+    return (x > y) - (x < y);
+}
+
+static bool do_bench(int argc, char *argv[])
+{
+    bool reset = argc > 1 && strcmp(argv[1], "-r") == 0;
+    int first = reset ? 2 : 1;
+    int reps = 0;
+    if (argc < first + 2) {
+        report(1, "%s needs a repetition count and a command", argv[0]);
+        return false;
+    }
+    if (!get_int(argv[first], &reps) || reps <= 0) {
+        report(1, "Invalid number of repetitions '%s'", argv[first]);
+        return false;
+    }
+    if (reset && !state_helper) {
+        report(1, "Resetting state between repetitions is not supported");
+        return false;
+    }
+
+    int64_t *ns = calloc_or_fail(reps, sizeof(int64_t), "do_bench");
+    int64_t *ticks = calloc_or_fail(reps, sizeof(int64_t), "do_bench");
+    int cmd_argc = argc - first - 1;
+    char **cmd_argv = argv + first + 1;
+    bool ok = !reset || state_helper(STATE_SAVE);
+    int done = 0;
+    int64_t total = 0;
+
+    /* Time the command, not the printing and logging of its output */
+    int old_verblevel = verblevel;
+    set_verblevel(0);
+    while (ok && done < reps) {
+        if (reset && done > 0 && !state_helper(STATE_RESTORE)) {
+            ok = false;
+            break;
+        }
+        int64_t start_ns = monotonic_ns();
+        int64_t start_ticks = cpucycles();
+        ok = interpret_cmda(cmd_argc, cmd_argv);
+        ticks[done] = cpucycles() - start_ticks;
+        ns[done] = monotonic_ns() - start_ns;
+        total += ns[done];
+        done++;
+    }
+    set_verblevel(old_verblevel);
+    if (reset)
+        state_helper(STATE_DISCARD);
+
+    if (!ok) {
+        report(1,
+               "Benchmark stopped after %d of %d repetitions, run '%s' alone "
+               "to see why",
+               done, reps, cmd_argv[0]);
+    } else {
+        qsort(ns, reps, sizeof(int64_t), cmp_int64);
+        qsort(ticks, reps, sizeof(int64_t), cmp_int64);
+        int p99 = (reps * 99 + 99) / 100 - 1;
+        report(1,
+               "%d reps of '%s': min %ld ns, median %ld ns, p99 %ld ns, "
+               "max %ld ns",
+               reps, cmd_argv[0], (long) ns[0], (long) ns[reps / 2],
+               (long) ns[p99], (long) ns[reps - 1]);
+        report(1, "Mean %.0f ns, %.1f ops/sec, median %ld ticks",
+               (double) total / reps, 1e9 * reps / (total ? total : 1),
+               (long) ticks[reps / 2]);
+    }
+
+    free_array(ns, reps, sizeof(int64_t));
+    free_array(ticks, reps, sizeof(int64_t));
+    return ok;
+}
+
+static bool do_perf(int argc, char *argv[])
+{
+    if (argc < 2) {
+        report(1, "%s needs a command", argv[0]);
+        return false;
+    }
+
+    /* Run the command anyway, so that scripts behave the same without
+     * counters
+     */
+    perf_counters_t pc;
+    if (!perf_open(&pc)) {
+        report(1, "Hardware counters unavailable: %s", strerror(errno));
+        return interpret_cmda(argc - 1, argv + 1);
+    }
+
+    int64_t counts[PERF_EVENTS];
+    perf_start(&pc);
+    bool ok = interpret_cmda(argc - 1, argv + 1);
+    perf_stop(&pc, counts);
+    perf_close(&pc);
+
+    for (int i = 0; i < PERF_EVENTS; i++) {
+        if (counts[i] < 0)
+            report(1, "%15s  %s", "<not counted>", perf_event_names[i]);
+        else
+            report(1, "%15ld  %s", (long) counts[i], perf_event_names[i]);
+    }
+    if (counts[PERF_CYCLES] > 0 && counts[PERF_INSTRUCTIONS] >= 0)
+        report(1, "%15.2f  insn per cycle",
+               (double) counts[PERF_INSTRUCTIONS] / counts[PERF_CYCLES]);
+
+    return ok;
+}
+
 static bool use_linenoise = true;
 static int web_fd;
 
+/* Event loop of the web server, or -1 when connections are served one by one */
+static int web_evfd = -1;
+
 static bool do_web(int argc, char *argv[])
 {
     int port = 9999;
@@ -406,6 +1086,7 @@ static bool do_web(int argc, char *argv[])
     if (web_fd > 0) {
         printf("listen on port %d, fd is %d\n", port, web_fd);
         use_linenoise = false;
+        web_evfd = web_event_open(web_fd);
     } else {
         perror("ERROR");
         exit(web_fd);
@@ -418,6 +1099,8 @@ void init_cmd()
 {
     cmd_list = NULL;
     param_list = NULL;
+    memset(cmd_table, 0, sizeof(cmd_table));
+    memset(param_table, 0, sizeof(param_table));
     err_cnt = 0;
     quit_flag = false;
 
@@ -428,14 +1111,32 @@ void init_cmd()
     ADD_COMMAND(quit, "Exit program", "");
     ADD_COMMAND(source, "Read commands from source file", "");
     ADD_COMMAND(log, "Copy output to file", "file");
+    ADD_COMMAND(json, "Write one JSON line of results per command to file",
+                "file");
     ADD_COMMAND(time, "Time command execution", "cmd arg ...");
+    ADD_COMMAND(perf,
+                "Count cycles, instructions, cache and branch misses of "
+                "command",
+                "cmd arg ...");
+    ADD_COMMAND(bench,
+                "Run command n times, with its output suppressed, and report "
+                "latency percentiles. With -r, restore state before each run",
+                "[-r] n cmd arg ...");
     ADD_COMMAND(web, "Read commands from builtin web server", "[port]");
+    ADD_COMMAND(repeat, "Run the following lines up to '}' n times", "n {");
+    ADD_COMMAND(set, "Set variable, referenced as $name in arguments",
+                "[name value]");
+    ADD_COMMAND(inc, "Add delta (default 1) to integer variable",
+                "name [delta]");
     add_cmd("#", do_comment_cmd, "Display comment", "...");
     add_param("simulation", &simulation, "Start/Stop simulation mode", NULL);
     add_param("verbose", &verblevel, "Verbosity level", NULL);
     add_param("error", &err_limit, "Number of errors until exit", NULL);
     add_param("echo", &echo, "Do/don't echo commands", NULL);
     add_param("entropy", &show_entropy, "Show/Hide Shannon entropy", NULL);
+    add_param("compile", &compile_mode,
+              "Pre-parse whole files read by 'source' before running them",
+              NULL);
 
     init_in();
     init_time(&last_time);
@@ -483,60 +1184,81 @@ static void init_in()
     buf_stack = NULL;
 }
 
+/* Echo a line read from input, as if it had been typed */
+static void echo_line(char *line)
+{
+    if (echo) {
+        report_noreturn(1, prompt);
+        report(1, "%s", line);
+    }
+}
+
 /* Read command from input file.
+ * Lines are located with memchr and handed out in place, terminated by
+ * overwriting their newline.  A partial line at the end of the buffer is
+ * moved to the front before reading more input.
  * When hit EOF, close that file and return NULL
  */
 static char *readline()
 {
-    char c;
-    char *lptr = linebuf;
-
     if (!buf_stack)
         return NULL;
 
-    for (int cnt = 0; cnt < RIO_BUFSIZE - 2; cnt++) {
-        if (buf_stack->count <= 0) {
-            /* Need to read from input file */
-            buf_stack->count = read(buf_stack->fd, buf_stack->buf, RIO_BUFSIZE);
-            buf_stack->bufptr = buf_stack->buf;
-            if (buf_stack->count <= 0) {
-                /* Encountered EOF */
-                pop_file();
-                if (cnt > 0) {
-                    /* Last line of file did not terminate with newline. */
-                    /*  Terminate line & return it */
-                    *lptr++ = '\n';
-                    *lptr++ = '\0';
-                    if (echo) {
-                        report_noreturn(1, prompt);
-                        report_noreturn(1, linebuf);
-                    }
-                    return linebuf;
-                }
-                return NULL;
-            }
+    rio_t *rio = buf_stack;
+    for (;;) {
+        char *nl = rio->count > 0 ? memchr(rio->bufptr, '\n', rio->count)
+                                  : NULL;
+        if (nl && nl - rio->bufptr < RIO_BUFSIZE - 2) {
+            char *line = rio->bufptr;
+            *nl = '\0';
+            rio->count -= nl + 1 - line;
+            rio->bufptr = nl + 1;
+            echo_line(line);
+            return line;
         }
 
-        /* Have text in buffer */
-        c = *buf_stack->bufptr++;
-        *lptr++ = c;
-        buf_stack->count--;
-        if (c == '\n')
-            break;
-    }
-
-    if (c != '\n') {
-        /* Hit buffer limit.  Artificially terminate line */
-        *lptr++ = '\n';
-    }
-    *lptr++ = '\0';
+        if (rio->count >= RIO_BUFSIZE - 2) {
+            /* Hit buffer limit.  Artificially terminate line */
+            memcpy(linebuf, rio->bufptr, RIO_BUFSIZE - 2);
+            linebuf[RIO_BUFSIZE - 2] = '\0';
+            rio->count -= RIO_BUFSIZE - 2;
+            rio->bufptr += RIO_BUFSIZE - 2;
+            echo_line(linebuf);
+            return linebuf;
+        }
 
-    if (echo) {
-        report_noreturn(1, prompt);
-        report_noreturn(1, linebuf);
+        /* Need to read from input file */
+        if (rio->count > 0 && rio->bufptr != rio->buf)
+            memmove(rio->buf, rio->bufptr, rio->count);
+        if (rio->count < 0)
+            rio->count = 0;
+        rio->bufptr = rio->buf;
+        int n = read(rio->fd, rio->buf + rio->count, RIO_BUFSIZE - rio->count);
+        if (n <= 0) {
+            /* Encountered EOF */
+            int cnt = rio->count;
+            if (cnt > 0) {
+                /* Last line of file did not terminate with newline. */
+                /*  Terminate line & return it */
+                memcpy(linebuf, rio->buf, cnt);
+                linebuf[cnt] = '\0';
+            }
+            pop_file();
+            if (cnt > 0) {
+                echo_line(linebuf);
+                return linebuf;
+            }
+            return NULL;
+        }
+        rio->count += n;
     }
+}
 
-    return linebuf;
+/* Is a complete line already waiting in the input buffer? */
+static bool line_buffered()
+{
+    return buf_stack && buf_stack->count > 0 &&
+           memchr(buf_stack->bufptr, '\n', buf_stack->count);
 }
 
 static bool cmd_done()
@@ -554,6 +1276,54 @@ static bool cmd_done()
  * If nfds == 0, this indicates that there is no pending network activity
  */
 int web_connfd;
+
+/* Run a command received by the web server, replying on connection fd */
+static void web_serve(int fd, char *cmdline)
+{
+    web_connfd = fd;
+    interpret_cmd(cmdline);
+    report_flush();
+    web_connfd = 0;
+}
+
+/* Serve the web client(s) waiting on the listening or event descriptor */
+static void web_handle()
+{
+    if (web_evfd >= 0) {
+        web_event_process(web_evfd, web_serve);
+        return;
+    }
+
+    struct sockaddr_in clientaddr;
+    socklen_t clientlen = sizeof(clientaddr);
+    web_connfd = accept(web_fd, (struct sockaddr *) &clientaddr, &clientlen);
+
+    char *p = web_recv(web_connfd, &clientaddr);
+    char *buffer = "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\n\r\n";
+    web_send(web_connfd, buffer);
+
+    if (p)
+        interpret_cmd(p);
+    free(p);
+    report_flush();
+    close(web_connfd);
+    web_connfd = 0;
+}
+
+/* Number of buffered lines run between checks for web clients */
+#define WEB_POLL_LINES 64
+
+/* Serve web clients if any are waiting, without blocking */
+static void web_poll(int wfd)
+{
+    fd_set readset;
+    struct timeval zero = {0, 0};
+    FD_ZERO(&readset);
+    FD_SET(wfd, &readset);
+    if (select(wfd + 1, &readset, NULL, NULL, &zero) > 0)
+        web_handle();
+}
+
 static int cmd_select(int nfds,
                       fd_set *readfds,
                       fd_set *writefds,
@@ -562,10 +1332,26 @@ static int cmd_select(int nfds,
 {
     int infd;
     fd_set local_readset;
+    /* Descriptor that is readable when the web server has work */
+    int wfd = web_evfd >= 0 ? web_evfd : web_fd;
 
     if (cmd_done())
         return 0;
 
+    /* No need to wait on a file whose next line is already buffered, but
+     * web clients must not wait for the whole file.
+     */
+    if (!block_flag && buf_stack->fd != STDIN_FILENO && line_buffered()) {
+        static unsigned int buffered_lines = 0;
+        if (web_fd > 0 && ++buffered_lines % WEB_POLL_LINES == 0)
+            web_poll(wfd);
+
+        char *cmdline = readline();
+        if (cmdline)
+            interpret_cmd(cmdline);
+        return 1;
+    }
+
     if (!block_flag) {
         /* Process any commands in input buffer */
         if (!readfds)
@@ -577,8 +1363,8 @@ static int cmd_select(int nfds,
         FD_SET(infd, readfds);
 
         /* If web not ready listen */
-        if (web_fd != -1)
-            FD_SET(web_fd, readfds);
+        if (wfd != -1)
+            FD_SET(wfd, readfds);
 
         if (infd == STDIN_FILENO && prompt_flag) {
             printf("%s", prompt);
@@ -588,8 +1374,8 @@ static int cmd_select(int nfds,
 
         if (infd >= nfds)
             nfds = infd + 1;
-        if (web_fd >= nfds)
-            nfds = web_fd + 1;
+        if (wfd >= nfds)
+            nfds = wfd + 1;
     }
     if (nfds == 0)
         return 0;
@@ -608,22 +1394,10 @@ static int cmd_select(int nfds,
         char *cmdline = readline();
         if (cmdline)
             interpret_cmd(cmdline);
-    } else if (readfds && FD_ISSET(web_fd, readfds)) {
-        FD_CLR(web_fd, readfds);
+    } else if (readfds && FD_ISSET(wfd, readfds)) {
+        FD_CLR(wfd, readfds);
         result--;
-        struct sockaddr_in clientaddr;
-        socklen_t clientlen = sizeof(clientaddr);
-        web_connfd =
-            accept(web_fd, (struct sockaddr *) &clientaddr, &clientlen);
-
-        char *p = web_recv(web_connfd, &clientaddr);
-        char *buffer = "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\n\r\n";
-        web_send(web_connfd, buffer);
-
-        if (p)
-            interpret_cmd(p);
-        free(p);
-        close(web_connfd);
+        web_handle();
     }
     return result;
 }
@@ -18,13 +18,16 @@ typedef bool (*cmd_func_t)(int argc, char *argv[]);
 
 /* Information about each command */
 
-/* Organized as linked list in alphabetical order */
+/* Organized as linked list in alphabetical order, and chained in a hash
+ * table for lookup by name
+ */
 typedef struct __cmd_element {
     char *name;
     cmd_func_t operation;
     char *summary;
     char *param;
     struct __cmd_element *next;
+    struct __cmd_element *hash_next;
 } cmd_element_t;
 
 /* Optionally supply function that gets invoked when parameter changes */
@@ -38,6 +41,7 @@ typedef struct __param_element {
     /* Function that gets called whenever parameter changes */
     setter_func_t setter;
     struct __param_element *next;
+    struct __param_element *hash_next;
 } param_element_t;
 
 /* Initialize interpreter */
@@ -56,6 +60,17 @@ bool get_int(char *vname, int *loc);
 /* Add function to be executed as part of program exit */
 void add_quit_helper(cmd_func_t qf);
 
+/* Operations on program state requested by 'bench -r' */
+typedef enum { STATE_SAVE, STATE_RESTORE, STATE_DISCARD } state_op_t;
+
+/* Save state before the first repetition, restore it before each of the
+ * following ones, and discard the saved copy at the end.
+ */
+typedef bool (*state_func_t)(state_op_t op);
+
+/* Set function that saves and restores state between benchmark runs */
+void set_state_helper(state_func_t sf);
+
 /* Turn echoing on/off */
 void set_echo(bool on);
 
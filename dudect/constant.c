@@ -1,5 +1,6 @@
 #include <assert.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "constant.h"
@@ -7,12 +8,25 @@
 #include "queue.h"
 #include "random.h"
 
-/* Maintain a queue independent from the qtest since
- * we do not want the test to affect the original functionality
+/* Maintain queues independent from the qtest since
+ * we do not want the test to affect the original functionality.
+ *
+ * Rebuilding a queue for every sample costs far more than the operation
+ * being measured, so a few queues are built once and each sample takes the
+ * one closest in size, growing or shrinking it as needed.  With the inputs
+ * of a batch sharing one random size (see prepare_inputs), the queues settle
+ * at the size of each class and setup work becomes negligible.
+ *
+ * Every measuring thread has queues of its own.
  */
-static struct list_head *l = NULL;
+#define N_DUT_QUEUES 2
 
-#define dut_new() ((void) (l = q_new()))
+static __thread struct list_head *queues[N_DUT_QUEUES];
+static __thread int queue_len[N_DUT_QUEUES];
+
+/* Queue of the current sample, and its length */
+static __thread struct list_head *l = NULL;
+static __thread int *dut_len = NULL;
 
 #define dut_size(n)                                \
     do {                                           \
@@ -34,15 +48,34 @@ static struct list_head *l = NULL;
             q_insert_tail(l, s); \
     } while (0)
 
-#define dut_free() ((void) (q_free(l)))
+bool dut_serialize = false;
+
+#define dut_ticks_start() (dut_serialize ? cpucycles_start() : cpucycles())
+#define dut_ticks_stop() (dut_serialize ? cpucycles_stop() : cpucycles())
 
-static char random_string[N_MEASURES][8];
-static int random_string_iter = 0;
+static __thread char random_string[N_MEASURES][8];
+static __thread int random_string_iter = 0;
 
 /* Implement the necessary queue interface to simulation */
 void init_dut(void)
 {
+    for (int k = 0; k < N_DUT_QUEUES; k++) {
+        if (!queues[k]) {
+            queues[k] = q_new();
+            queue_len[k] = 0;
+        }
+    }
+}
+
+void free_dut(void)
+{
+    for (int k = 0; k < N_DUT_QUEUES; k++) {
+        q_free(queues[k]);
+        queues[k] = NULL;
+        queue_len[k] = 0;
+    }
     l = NULL;
+    dut_len = NULL;
 }
 
 static char *get_random_string(void)
@@ -51,13 +84,58 @@ static char *get_random_string(void)
     return random_string[random_string_iter];
 }
 
+/* Select the queue closest to n elements and bring it to n elements.  One
+ * element more is built and released last, so that the allocator is in the
+ * same state whatever the previous size was.
+ */
+static bool dut_resize(int n)
+{
+    int best = 0;
+    for (int k = 1; k < N_DUT_QUEUES; k++) {
+        if (abs(queue_len[k] - n) < abs(queue_len[best] - n))
+            best = k;
+    }
+    l = queues[best];
+    dut_len = &queue_len[best];
+    if (!l)
+        return false;
+
+    while (*dut_len <= n) {
+        if (!q_insert_head(l, get_random_string()))
+            return false;
+        (*dut_len)++;
+    }
+    while (*dut_len > n) {
+        element_t *e = q_remove_head(l, NULL, 0);
+        if (!e)
+            return false;
+        q_release_element(e);
+        (*dut_len)--;
+    }
+    return true;
+}
+
+/* Size of the queue to measure on, taken from the input of a sample */
+static int input_size(const uint8_t *input_data, size_t i)
+{
+    return *(uint16_t *) (input_data + i * CHUNK_SIZE) % 10000;
+}
+
 void prepare_inputs(uint8_t *input_data, uint8_t *classes)
 {
     randombytes(input_data, N_MEASURES * CHUNK_SIZE);
+
+    /* Class 1 inputs of a batch share one random queue size, which keeps
+     * their queue from being resized between samples.
+     */
+    uint16_t size;
+    randombytes((uint8_t *) &size, sizeof(size));
     for (size_t i = 0; i < N_MEASURES; i++) {
         classes[i] = randombit();
         if (classes[i] == 0)
             memset(input_data + (size_t) i * CHUNK_SIZE, 0, CHUNK_SIZE);
+        else
+            memcpy(input_data + (size_t) i * CHUNK_SIZE, &size, sizeof(size));
     }
 
     for (size_t i = 0; i < N_MEASURES; ++i) {
@@ -73,90 +151,111 @@ bool measure(int64_t *before_ticks,
              int mode)
 {
     assert(mode == DUT(insert_head) || mode == DUT(insert_tail) ||
-           mode == DUT(remove_head) || mode == DUT(remove_tail));
+           mode == DUT(remove_head) || mode == DUT(remove_tail) ||
+           mode == DUT(size) || mode == DUT(delete_mid) ||
+           mode == DUT(reverse));
 
+    bool ok = true;
     switch (mode) {
     case DUT(insert_head):
-        for (size_t i = DROP_SIZE; i < N_MEASURES - DROP_SIZE; i++) {
+        for (size_t i = DROP_SIZE; ok && i < N_MEASURES - DROP_SIZE; i++) {
             char *s = get_random_string();
-            dut_new();
-            dut_insert_head(
-                get_random_string(),
-                *(uint16_t *) (input_data + i * CHUNK_SIZE) % 10000);
-            int before_size = q_size(l);
-            before_ticks[i] = cpucycles();
+            if (!dut_resize(input_size(input_data, i))) {
+                ok = false;
+                break;
+            }
+            before_ticks[i] = dut_ticks_start();
             dut_insert_head(s, 1);
-            after_ticks[i] = cpucycles();
-            int after_size = q_size(l);
-            dut_free();
-            if (before_size != after_size - 1)
-                return false;
+            after_ticks[i] = dut_ticks_stop();
+            (*dut_len)++;
         }
         break;
     case DUT(insert_tail):
-        for (size_t i = DROP_SIZE; i < N_MEASURES - DROP_SIZE; i++) {
+        for (size_t i = DROP_SIZE; ok && i < N_MEASURES - DROP_SIZE; i++) {
             char *s = get_random_string();
-            dut_new();
-            dut_insert_head(
-                get_random_string(),
-                *(uint16_t *) (input_data + i * CHUNK_SIZE) % 10000);
-            int before_size = q_size(l);
-            before_ticks[i] = cpucycles();
+            if (!dut_resize(input_size(input_data, i))) {
+                ok = false;
+                break;
+            }
+            before_ticks[i] = dut_ticks_start();
             dut_insert_tail(s, 1);
-            after_ticks[i] = cpucycles();
-            int after_size = q_size(l);
-            dut_free();
-            if (before_size != after_size - 1)
-                return false;
+            after_ticks[i] = dut_ticks_stop();
+            (*dut_len)++;
         }
         break;
     case DUT(remove_head):
-        for (size_t i = DROP_SIZE; i < N_MEASURES - DROP_SIZE; i++) {
-            dut_new();
-            dut_insert_head(
-                get_random_string(),
-                *(uint16_t *) (input_data + i * CHUNK_SIZE) % 10000 + 1);
-            int before_size = q_size(l);
-            before_ticks[i] = cpucycles();
+        for (size_t i = DROP_SIZE; ok && i < N_MEASURES - DROP_SIZE; i++) {
+            if (!dut_resize(input_size(input_data, i) + 1)) {
+                ok = false;
+                break;
+            }
+            before_ticks[i] = dut_ticks_start();
             element_t *e = q_remove_head(l, NULL, 0);
-            after_ticks[i] = cpucycles();
-            int after_size = q_size(l);
+            after_ticks[i] = dut_ticks_stop();
             if (e)
                 q_release_element(e);
-            dut_free();
-            if (before_size != after_size + 1)
-                return false;
+            (*dut_len)--;
         }
         break;
     case DUT(remove_tail):
-        for (size_t i = DROP_SIZE; i < N_MEASURES - DROP_SIZE; i++) {
-            dut_new();
-            dut_insert_head(
-                get_random_string(),
-                *(uint16_t *) (input_data + i * CHUNK_SIZE) % 10000 + 1);
-            int before_size = q_size(l);
-            before_ticks[i] = cpucycles();
+        for (size_t i = DROP_SIZE; ok && i < N_MEASURES - DROP_SIZE; i++) {
+            if (!dut_resize(input_size(input_data, i) + 1)) {
+                ok = false;
+                break;
+            }
+            before_ticks[i] = dut_ticks_start();
             element_t *e = q_remove_tail(l, NULL, 0);
-            after_ticks[i] = cpucycles();
-            int after_size = q_size(l);
+            after_ticks[i] = dut_ticks_stop();
             if (e)
                 q_release_element(e);
-            dut_free();
-            if (before_size != after_size + 1)
-                return false;
+            (*dut_len)--;
         }
         break;
-    default:
-        for (size_t i = DROP_SIZE; i < N_MEASURES - DROP_SIZE; i++) {
-            dut_new();
-            dut_insert_head(
-                get_random_string(),
-                *(uint16_t *) (input_data + i * CHUNK_SIZE) % 10000);
-            before_ticks[i] = cpucycles();
+    case DUT(size):
+        for (size_t i = DROP_SIZE; ok && i < N_MEASURES - DROP_SIZE; i++) {
+            if (!dut_resize(input_size(input_data, i))) {
+                ok = false;
+                break;
+            }
+            before_ticks[i] = dut_ticks_start();
             dut_size(1);
-            after_ticks[i] = cpucycles();
-            dut_free();
+            after_ticks[i] = dut_ticks_stop();
+        }
+        break;
+    case DUT(delete_mid):
+        for (size_t i = DROP_SIZE; ok && i < N_MEASURES - DROP_SIZE; i++) {
+            if (!dut_resize(input_size(input_data, i) + 1)) {
+                ok = false;
+                break;
+            }
+            before_ticks[i] = dut_ticks_start();
+            bool deleted = q_delete_mid(l);
+            after_ticks[i] = dut_ticks_stop();
+            if (!deleted)
+                ok = false;
+            (*dut_len)--;
+        }
+        break;
+    case DUT(reverse):
+        for (size_t i = DROP_SIZE; ok && i < N_MEASURES - DROP_SIZE; i++) {
+            if (!dut_resize(input_size(input_data, i))) {
+                ok = false;
+                break;
+            }
+            before_ticks[i] = dut_ticks_start();
+            q_reverse(l);
+            after_ticks[i] = dut_ticks_stop();
         }
+        break;
     }
-    return true;
+
+    /* Queues must have the sizes the operations should have left.  Checking
+     * once per batch keeps a walk of the queue out of the time between
+     * samples.
+     */
+    for (int k = 0; ok && k < N_DUT_QUEUES; k++) {
+        if (q_size(queues[k]) != queue_len[k])
+            ok = false;
+    }
+    return ok;
 }
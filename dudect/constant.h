@@ -16,7 +16,10 @@
     _(insert_head) \
     _(insert_tail) \
     _(remove_head) \
-    _(remove_tail)
+    _(remove_tail) \
+    _(size)        \
+    _(delete_mid)  \
+    _(reverse)
 
 #define DUT(x) DUT_##x
 
@@ -26,7 +29,12 @@ enum {
 #undef _
 };
 
+/* Read serialized cycle counts around measured operations */
+extern bool dut_serialize;
+
+/* Build and release the queues measured by the calling thread */
 void init_dut();
+void free_dut();
 void prepare_inputs(uint8_t *input_data, uint8_t *classes);
 bool measure(int64_t *before_ticks,
              int64_t *after_ticks,
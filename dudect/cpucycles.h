@@ -26,4 +26,46 @@ static inline int64_t cpucycles(void)
 #endif
 }
 
+/* Serialized reads for the start and the end of a timed region.  The start
+ * waits for earlier instructions to complete and keeps later ones from
+ * starting before the read; the end waits for the region to complete.
+ */
+static inline int64_t cpucycles_start(void)
+{
+#if defined(__i386__) || defined(__x86_64__)
+    unsigned int hi, lo;
+    __asm__ volatile("lfence\n\trdtsc\n\tlfence"
+                     : "=a"(lo), "=d"(hi)
+                     :
+                     : "memory");
+    return ((int64_t) lo) | (((int64_t) hi) << 32);
+
+#elif defined(__aarch64__)
+    uint64_t val;
+    asm volatile("isb\n\tmrs %0, cntvct_el0\n\tisb" : "=r"(val) : : "memory");
+    return val;
+#else
+#error Unsupported Architecture
+#endif
+}
+
+static inline int64_t cpucycles_stop(void)
+{
+#if defined(__i386__) || defined(__x86_64__)
+    unsigned int hi, lo;
+    __asm__ volatile("rdtscp\n\tlfence"
+                     : "=a"(lo), "=d"(hi)
+                     :
+                     : "ecx", "memory");
+    return ((int64_t) lo) | (((int64_t) hi) << 32);
+
+#elif defined(__aarch64__)
+    uint64_t val;
+    asm volatile("isb\n\tmrs %0, cntvct_el0" : "=r"(val) : : "memory");
+    return val;
+#else
+#error Unsupported Architecture
+#endif
+}
+
 #endif
@@ -26,16 +26,25 @@
  *    variable time.
  */
 
+#define _GNU_SOURCE /* CPU affinity */
 #include <assert.h>
 #include <math.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "../console.h"
 #include "../random.h"
 
+/* Switching cautious mode needs the internal harness interface */
+#define INTERNAL 1
+#include "../harness.h"
+
 #include "constant.h"
 #include "fixture.h"
 #include "ttest.h"
@@ -43,8 +52,49 @@
 #define ENOUGH_MEASURE 10000
 #define TEST_TRIES 10
 
+/* Number of cropped tests, each keeping the measurements below a percentile */
+#define N_PERCENTILES 100
+
+/* Uncropped test, cropped tests, then the second order test */
+#define N_TESTS (1 + N_PERCENTILES + 1)
+
+/* Measurements a test needs before its t value is taken into account */
+#define ENOUGH_TEST_MEASURE (ENOUGH_MEASURE / 10)
+
+/* Measurements per class of the uncropped test needed before the second
+ * order test starts, so that the means it centers on have settled
+ */
+#define SECOND_ORDER_WARMUP 1000
+
 static t_context_t *t;
 
+/* Upper bound on measuring threads */
+#define MAX_THREADS 64
+
+/* Time spent measuring without recording before sampling in stable mode,
+ * long enough for the CPU to leave low frequency states
+ */
+#define WARMUP_NS 50000000
+
+int dudect_threads = 1;
+int dudect_stable = 0;
+int dudect_sequential = 0;
+
+/* Cropping thresholds, set from the first batch of every try */
+static int64_t percentiles[N_PERCENTILES];
+static bool have_percentiles;
+
+/* Measurement buffers, allocated once per test_const() run and reused by
+ * every batch so that the allocator stays out of the timed loop.
+ */
+typedef struct {
+    int64_t *before_ticks;
+    int64_t *after_ticks;
+    int64_t *exec_times;
+    uint8_t *classes;
+    uint8_t *input_data;
+} meas_ctx_t;
+
 /* threshold values for Welch's t-test */
 enum {
     t_threshold_bananas = 500, /* Test failed with overwhelming probability */
@@ -64,33 +114,131 @@ static void differentiate(int64_t *exec_times,
         exec_times[i] = after_ticks[i] - before_ticks[i];
 }
 
-static void update_statistics(const int64_t *exec_times, uint8_t *classes)
+static int cmp_int64(const void *a, const void *b)
 {
+    int64_t x = *(const int64_t *) a, y = *(const int64_t *) b;
+    return (x > y) - (x < y);
+}
+
+/* Set cropping thresholds so that test i keeps the fastest
+ * 1 - 0.5^(10 * (i + 1) / N_PERCENTILES) of the measurements, which packs
+ * most thresholds close to the fat right tail.  Sorts exec_times.
+ */
+static void prepare_percentiles(int64_t *exec_times)
+{
+    qsort(exec_times, N_MEASURES, sizeof(int64_t), cmp_int64);
+
+    /* Skip dropped measurements */
+    size_t first = 0;
+    while (first < N_MEASURES && exec_times[first] <= 0)
+        first++;
+    size_t cnt = N_MEASURES - first;
+    if (!cnt)
+        return;
+
+    for (size_t i = 0; i < N_PERCENTILES; i++) {
+        double which = 1 - pow(0.5, 10 * (double) (i + 1) / N_PERCENTILES);
+        size_t pos = first + (size_t) (which * cnt);
+        percentiles[i] = exec_times[pos < N_MEASURES ? pos : N_MEASURES - 1];
+    }
+    have_percentiles = true;
+}
+
+/* Measurement of one sample, sortable by execution time */
+typedef struct {
+    int64_t time;
+    uint8_t class;
+} sample_t;
+
+static int cmp_sample(const void *a, const void *b)
+{
+    int64_t x = ((const sample_t *) a)->time, y = ((const sample_t *) b)->time;
+    return (x > y) - (x < y);
+}
+
+static void update_statistics(t_context_t *tests,
+                              const int64_t *exec_times,
+                              uint8_t *classes)
+{
+    sample_t samples[N_MEASURES];
+    size_t n = 0;
     for (size_t i = 0; i < N_MEASURES; i++) {
-        int64_t difference = exec_times[i];
         /* CPU cycle counter overflowed or dropped measurement */
-        if (difference <= 0)
+        if (exec_times[i] <= 0)
             continue;
+        samples[n].time = exec_times[i];
+        samples[n].class = classes[i];
+        n++;
+    }
+
+    /* Sorted by time, the samples kept by each crop are a prefix */
+    qsort(samples, n, sizeof(sample_t), cmp_sample);
+    double x[N_MEASURES], sq[N_MEASURES];
+    uint8_t cls[N_MEASURES];
+    for (size_t i = 0; i < n; i++) {
+        x[i] = samples[i].time;
+        cls[i] = samples[i].class;
+    }
+
+    /* do a second-order test on the centered squared execution time,
+     * once the means have settled.
+     */
+    if (tests[0].n[0] > SECOND_ORDER_WARMUP) {
+        for (size_t i = 0; i < n; i++) {
+            double centered = x[i] - tests[0].mean[cls[i]];
+            sq[i] = centered * centered;
+        }
+        t_push_many(&tests[N_TESTS - 1], sq, cls, n);
+    }
+
+    /* do a t-test on the execution time */
+    t_push_many(&tests[0], x, cls, n);
+
+    /* do a t-test on cropped execution times, for several cropping
+     * thresholds.  Thresholds grow with the crop index.
+     */
+    size_t kept = 0;
+    for (size_t crop = 0; crop < N_PERCENTILES; crop++) {
+        while (kept < n && x[kept] < percentiles[crop])
+            kept++;
+        t_push_many(&tests[crop + 1], x, cls, kept);
+    }
+}
 
-        /* do a t-test on the execution time */
-        t_push(t, difference, classes[i]);
+/* Test with the largest t value among those with enough measurements */
+static t_context_t *max_test(void)
+{
+    size_t ret = 0;
+    double max = 0;
+    for (size_t i = 0; i < N_TESTS; i++) {
+        if (t[i].n[0] + t[i].n[1] < ENOUGH_TEST_MEASURE)
+            continue;
+        double x = fabs(t_compute(&t[i]));
+        if (max < x) {
+            max = x;
+            ret = i;
+        }
     }
+    return &t[ret];
 }
 
 static bool report(void)
 {
-    double max_t = fabs(t_compute(t));
-    double number_traces_max_t = t->n[0] + t->n[1];
-    double max_tau = max_t / sqrt(number_traces_max_t);
+    double number_traces = t[0].n[0] + t[0].n[1];
 
     printf("\033[A\033[2K");
-    printf("meas: %7.2lf M, ", (number_traces_max_t / 1e6));
-    if (number_traces_max_t < ENOUGH_MEASURE) {
+    printf("meas: %7.2lf M, ", (number_traces / 1e6));
+    if (number_traces < ENOUGH_MEASURE) {
         printf("not enough measurements (%.0f still to go).\n",
-               ENOUGH_MEASURE - number_traces_max_t);
+               ENOUGH_MEASURE - number_traces);
         return false;
     }
 
+    t_context_t *max_ctx = max_test();
+    double max_t = fabs(t_compute(max_ctx));
+    double number_traces_max_t = max_ctx->n[0] + max_ctx->n[1];
+    double max_tau = max_t / sqrt(number_traces_max_t);
+
     /* max_t: the t statistic value
      * max_tau: a t value normalized by sqrt(number of measurements).
      *          this way we can compare max_tau taken with different
@@ -116,57 +264,284 @@ static bool report(void)
     return true;
 }
 
-static bool doit(int mode)
+/* Outcome of a try, decided before ENOUGH_MEASURE in sequential mode */
+typedef enum { UNDECIDED, CONSTANT, LEAKY, CLEARLY_LEAKY } verdict_t;
+
+/* Stop as soon as the largest t value is clearly above a threshold, or
+ * projects to well below the moderate one at ENOUGH_MEASURE measurements,
+ * as t grows with the square root of the number of measurements.
+ */
+static verdict_t early_verdict(void)
+{
+    double number_traces = t[0].n[0] + t[0].n[1];
+    if (number_traces < ENOUGH_TEST_MEASURE)
+        return UNDECIDED;
+
+    double max_t = fabs(t_compute(max_test()));
+    if (max_t > t_threshold_bananas)
+        return CLEARLY_LEAKY;
+    if (max_t > t_threshold_moderate)
+        return LEAKY;
+    if (max_t * sqrt(ENOUGH_MEASURE / number_traces) <
+        t_threshold_moderate / 2)
+        return CONSTANT;
+    return UNDECIDED;
+}
+
+static void meas_free(meas_ctx_t *ctx)
 {
-    int64_t *before_ticks = calloc(N_MEASURES + 1, sizeof(int64_t));
-    int64_t *after_ticks = calloc(N_MEASURES + 1, sizeof(int64_t));
-    int64_t *exec_times = calloc(N_MEASURES, sizeof(int64_t));
-    uint8_t *classes = calloc(N_MEASURES, sizeof(uint8_t));
-    uint8_t *input_data = calloc(N_MEASURES * CHUNK_SIZE, sizeof(uint8_t));
+    free(ctx->before_ticks);
+    free(ctx->after_ticks);
+    free(ctx->exec_times);
+    free(ctx->classes);
+    free(ctx->input_data);
+}
 
-    if (!before_ticks || !after_ticks || !exec_times || !classes ||
-        !input_data) {
+static void meas_init(meas_ctx_t *ctx)
+{
+    /* Zeroed entries outside the measured range are skipped as dropped */
+    ctx->before_ticks = calloc(N_MEASURES + 1, sizeof(int64_t));
+    ctx->after_ticks = calloc(N_MEASURES + 1, sizeof(int64_t));
+    ctx->exec_times = calloc(N_MEASURES, sizeof(int64_t));
+    ctx->classes = calloc(N_MEASURES, sizeof(uint8_t));
+    ctx->input_data = calloc(N_MEASURES * CHUNK_SIZE, sizeof(uint8_t));
+
+    if (!ctx->before_ticks || !ctx->after_ticks || !ctx->exec_times ||
+        !ctx->classes || !ctx->input_data) {
+        meas_free(ctx);
         die();
     }
+}
 
-    prepare_inputs(input_data, classes);
+static bool doit(int mode, meas_ctx_t *ctx)
+{
+    prepare_inputs(ctx->input_data, ctx->classes);
 
-    bool ret = measure(before_ticks, after_ticks, input_data, mode);
-    differentiate(exec_times, before_ticks, after_ticks);
-    update_statistics(exec_times, classes);
+    bool ret =
+        measure(ctx->before_ticks, ctx->after_ticks, ctx->input_data, mode);
+    differentiate(ctx->exec_times, ctx->before_ticks, ctx->after_ticks);
+    if (!have_percentiles) {
+        /* The first batch only calibrates the crops */
+        prepare_percentiles(ctx->exec_times);
+        return false;
+    }
+    update_statistics(t, ctx->exec_times, ctx->classes);
     ret &= report();
 
-    free(before_ticks);
-    free(after_ticks);
-    free(exec_times);
-    free(classes);
-    free(input_data);
-
     return ret;
 }
 
+/* Thread measuring batches with queues and statistics of its own */
+typedef struct {
+    pthread_t thread;
+    int index;
+    int mode;
+    int batches;
+    bool ok;
+    meas_ctx_t ctx;
+    t_context_t t[N_TESTS];
+} worker_t;
+
+/* Number of CPUs the calling thread is allowed to run on */
+static int allowed_cpus(void)
+{
+#if defined(__linux__)
+    cpu_set_t allowed;
+    if (!sched_getaffinity(0, sizeof(allowed), &allowed))
+        return CPU_COUNT(&allowed);
+#endif
+    long cnt = sysconf(_SC_NPROCESSORS_ONLN);
+    return cnt > 0 ? cnt : 1;
+}
+
+/* Pin the calling thread to the k-th CPU it is allowed to run on */
+static void pin_cpu(int k)
+{
+#if defined(__linux__)
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed))
+        return;
+
+    int target = k % CPU_COUNT(&allowed);
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (!CPU_ISSET(cpu, &allowed) || target--)
+            continue;
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        return;
+    }
+#endif
+}
+
+/* Measure batches without recording them until WARMUP_NS have passed */
+static void warm_up(int mode, meas_ctx_t *ctx)
+{
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    do {
+        prepare_inputs(ctx->input_data, ctx->classes);
+        measure(ctx->before_ticks, ctx->after_ticks, ctx->input_data, mode);
+        clock_gettime(CLOCK_MONOTONIC, &now);
+    } while ((now.tv_sec - start.tv_sec) * 1000000000L + now.tv_nsec -
+                 start.tv_nsec <
+             WARMUP_NS);
+}
+
+static void *worker_run(void *arg)
+{
+    worker_t *w = arg;
+    pin_cpu(w->index);
+    init_dut();
+    if (dudect_stable)
+        warm_up(w->mode, &w->ctx);
+    for (int i = 0; i < w->batches; i++) {
+        meas_ctx_t *ctx = &w->ctx;
+        prepare_inputs(ctx->input_data, ctx->classes);
+        w->ok &= measure(ctx->before_ticks, ctx->after_ticks, ctx->input_data,
+                         w->mode);
+        differentiate(ctx->exec_times, ctx->before_ticks, ctx->after_ticks);
+        update_statistics(w->t, ctx->exec_times, ctx->classes);
+    }
+    free_dut();
+    return NULL;
+}
+
+/* Measure batches on several threads, merge their statistics and report.
+ * The crops are calibrated on the calling thread first, so that all
+ * workers crop at the same thresholds.
+ */
+static bool doit_parallel(int mode, meas_ctx_t *ctx, int threads, int batches)
+{
+    doit(mode, ctx);
+
+    worker_t *workers = calloc(threads, sizeof(worker_t));
+    if (!workers)
+        die();
+
+    int started = 0;
+    for (int k = 0; k < threads; k++) {
+        worker_t *w = &workers[k];
+        w->index = k;
+        w->mode = mode;
+        w->batches = (batches + threads - 1) / threads;
+        w->ok = true;
+        meas_init(&w->ctx);
+        for (size_t i = 0; i < N_TESTS; i++)
+            t_init(&w->t[i]);
+        if (pthread_create(&w->thread, NULL, worker_run, w)) {
+            meas_free(&w->ctx);
+            break;
+        }
+        started++;
+    }
+
+    bool ok = started > 0;
+    for (int k = 0; k < started; k++) {
+        worker_t *w = &workers[k];
+        pthread_join(w->thread, NULL);
+        ok &= w->ok;
+        for (size_t i = 0; i < N_TESTS; i++)
+            t_merge(&t[i], &w->t[i]);
+        meas_free(&w->ctx);
+    }
+    free(workers);
+
+    ok &= report();
+    return ok;
+}
+
 static void init_once(void)
 {
     init_dut();
-    t_init(t);
+    for (size_t i = 0; i < N_TESTS; i++)
+        t_init(&t[i]);
+    have_percentiles = false;
 }
 
 static bool test_const(char *text, int mode)
 {
     bool result = false;
-    t = malloc(sizeof(t_context_t));
+    int batches = ENOUGH_MEASURE / (N_MEASURES - DROP_SIZE * 2) + 1;
+    /* Threads sharing a CPU would add preemptions to the measurements */
+    int threads = dudect_threads;
+    if (threads > allowed_cpus())
+        threads = allowed_cpus();
+    if (threads > MAX_THREADS)
+        threads = MAX_THREADS;
+    if (threads < 1)
+        threads = 1;
+
+    meas_ctx_t ctx;
+    meas_init(&ctx);
+    t = malloc(N_TESTS * sizeof(t_context_t));
+    if (!t) {
+        meas_free(&ctx);
+        die();
+    }
+
+    /* Queue operations are validated elsewhere, and cautious mode would make
+     * every release walk all allocated blocks.
+     */
+    set_cautious_mode(false);
+
+    /* In stable mode, stay on one CPU with serialized cycle counts, and let
+     * the CPU reach a steady frequency first.  Workers pin themselves.
+     */
+#if defined(__linux__)
+    cpu_set_t saved_cpus;
+    bool pinned = dudect_stable && threads == 1 &&
+                  !sched_getaffinity(0, sizeof(saved_cpus), &saved_cpus);
+    if (pinned) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(sched_getcpu(), &set);
+        pinned = !sched_setaffinity(0, sizeof(set), &set);
+    }
+#endif
+    dut_serialize = dudect_stable;
+    if (dudect_stable && threads == 1) {
+        init_dut();
+        warm_up(mode, &ctx);
+    }
 
+    double used = 0;
+    verdict_t verdict = UNDECIDED;
     for (int cnt = 0; cnt < TEST_TRIES; ++cnt) {
         printf("Testing %s...(%d/%d)\n\n", text, cnt, TEST_TRIES);
         init_once();
-        for (int i = 0; i < ENOUGH_MEASURE / (N_MEASURES - DROP_SIZE * 2) + 1;
-             ++i)
-            result = doit(mode);
+        if (threads > 1) {
+            result = doit_parallel(mode, &ctx, threads, batches);
+        } else {
+            /* One more batch than needed, as the first calibrates the crops */
+            for (int i = 0; i < batches + 1; ++i) {
+                result = doit(mode, &ctx);
+                if (!dudect_sequential || !have_percentiles)
+                    continue;
+                verdict = early_verdict();
+                if (verdict != UNDECIDED) {
+                    result = verdict == CONSTANT;
+                    break;
+                }
+            }
+        }
+        used += t[0].n[0] + t[0].n[1];
         printf("\033[A\033[2K\033[A\033[2K");
-        if (result)
+        if (result || verdict == CLEARLY_LEAKY)
             break;
     }
+    if (dudect_sequential)
+        printf("%s: verdict after %.0f measurements\n", text, used);
+    free_dut();
+    dut_serialize = false;
+#if defined(__linux__)
+    if (pinned)
+        sched_setaffinity(0, sizeof(saved_cpus), &saved_cpus);
+#endif
+    set_cautious_mode(true);
     free(t);
+    meas_free(&ctx);
     return result;
 }
 
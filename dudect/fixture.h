@@ -4,6 +4,15 @@
 #include <stdbool.h>
 #include "constant.h"
 
+/* Number of threads measuring in parallel */
+extern int dudect_threads;
+
+/* Pin to a CPU, serialize cycle counts and warm up before measuring */
+extern int dudect_stable;
+
+/* Stop measuring as soon as the verdict is clear */
+extern int dudect_sequential;
+
 /* Interface to test if function is constant */
 #define _(x) bool is_##x##_const(void);
 DUT_FUNCS
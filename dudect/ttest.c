@@ -27,6 +27,45 @@ void t_push(t_context_t *ctx, double x, uint8_t class)
     ctx->m2[class] = ctx->m2[class] + delta * (x - ctx->mean[class]);
 }
 
+/* Push n samples at once.  The statistics of the batch are computed in two
+ * branch-free passes over the arrays, which the compiler can vectorize, and
+ * merged into ctx.
+ */
+void t_push_many(t_context_t *ctx,
+                 const double *x,
+                 const uint8_t *classes,
+                 size_t n)
+{
+    double n1 = 0, sum = 0, sum1 = 0;
+    for (size_t i = 0; i < n; i++) {
+        double c = classes[i];
+        n1 += c;
+        sum += x[i];
+        sum1 += c * x[i];
+    }
+
+    t_context_t batch;
+    t_init(&batch);
+    batch.n[0] = n - n1;
+    batch.n[1] = n1;
+    if (batch.n[0])
+        batch.mean[0] = (sum - sum1) / batch.n[0];
+    if (batch.n[1])
+        batch.mean[1] = sum1 / batch.n[1];
+
+    double m2_0 = 0, m2_1 = 0;
+    for (size_t i = 0; i < n; i++) {
+        double c = classes[i];
+        double d0 = x[i] - batch.mean[0], d1 = x[i] - batch.mean[1];
+        m2_0 += (1 - c) * d0 * d0;
+        m2_1 += c * d1 * d1;
+    }
+    batch.m2[0] = m2_0;
+    batch.m2[1] = m2_1;
+
+    t_merge(ctx, &batch);
+}
+
 double t_compute(t_context_t *ctx)
 {
     double var[2] = {0.0, 0.0};
@@ -47,3 +86,22 @@ void t_init(t_context_t *ctx)
     }
     return;
 }
+
+/* Add the measurements summarized by src to dst, as if they had been pushed
+ * to dst.  See the parallel algorithm of Chan et al. in
+ * https://en.wikipedia.org/wiki/Algorithms_for_calculating_variance
+ */
+void t_merge(t_context_t *dst, const t_context_t *src)
+{
+    for (int class = 0; class < 2; class ++) {
+        double n = dst->n[class] + src->n[class];
+        if (n == 0)
+            continue;
+
+        double delta = src->mean[class] - dst->mean[class];
+        dst->m2[class] += src->m2[class] +
+                          delta * delta * dst->n[class] * src->n[class] / n;
+        dst->mean[class] += delta * src->n[class] / n;
+        dst->n[class] = n;
+    }
+}
@@ -9,8 +9,15 @@ typedef struct {
     double n[2];
 } t_context_t;
 
+#include <stddef.h>
+
 void t_push(t_context_t *ctx, double x, uint8_t class);
+void t_push_many(t_context_t *ctx,
+                 const double *x,
+                 const uint8_t *classes,
+                 size_t n);
 double t_compute(t_context_t *ctx);
 void t_init(t_context_t *ctx);
+void t_merge(t_context_t *dst, const t_context_t *src);
 
 #endif
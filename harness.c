@@ -1,7 +1,9 @@
 /* Test support code */
 
+#include <pthread.h>
 #include <setjmp.h>
 #include <signal.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -27,6 +29,22 @@
 /* Byte to fill newly malloced space with */
 #define FILLCHAR 0x55
 
+/* Per-thread caching of freed blocks.
+ * Small blocks are rounded up to a multiple of CACHE_GRANULE bytes, and each
+ * thread keeps up to CACHE_DEPTH released blocks per size class so that
+ * parallel queue operations do not all contend on the system allocator.
+ * Caching is disabled under AddressSanitizer so that it keeps catching
+ * use-after-free.
+ */
+#define CACHE_GRANULE 16
+#define CACHE_CLASSES 9
+#define CACHE_MAX_SIZE (CACHE_GRANULE * (CACHE_CLASSES - 1))
+#if defined(__SANITIZE_ADDRESS__)
+#define CACHE_DEPTH 0
+#else
+#define CACHE_DEPTH 64
+#endif
+
 /* Data structures used by our code */
 
 /* Represent allocated blocks as doubly-linked list, with
@@ -40,26 +58,69 @@ typedef struct __block_element {
     /* Also place magic number at tail of every block */
 } block_element_t;
 
+/* List of allocated blocks is shared by all threads and guarded by
+ * block_lock.  Counters and flags are atomic so they can be polled without
+ * taking the lock.  The lock checks its owner, so that an exception raised
+ * while it is held can release it without knowing whether it is.
+ */
 static block_element_t *allocated = NULL;
-static size_t allocated_count = 0;
+static atomic_size_t allocated_count = 0;
+static pthread_mutex_t block_lock;
+static pthread_once_t block_lock_once = PTHREAD_ONCE_INIT;
+
+/* Released blocks kept by the current thread, chained through next */
+static __thread block_element_t *free_cache[CACHE_CLASSES];
+static __thread int free_cache_cnt[CACHE_CLASSES];
+
+/* Blocks and bytes handed out to the current thread */
+static __thread size_t thread_alloc_cnt = 0;
+static __thread size_t thread_alloc_bytes = 0;
+
+/* Drain the cache of a thread when it exits */
+static pthread_key_t cache_key;
+static pthread_once_t cache_key_once = PTHREAD_ONCE_INIT;
 
 /* Percent probability of malloc failure */
 int fail_probability = 0;
 
-static bool cautious_mode = true;
-static bool noallocate_mode = false;
-static bool error_occurred = false;
+static atomic_bool cautious_mode = true;
+static atomic_bool noallocate_mode = false;
+static atomic_bool error_occurred = false;
 static char *error_message = "";
 
 static int time_limit = 1;
 
-/* Data for managing exceptions */
+/* Data for managing exceptions.
+ * Exceptions are only supported on the thread that drives the tests.
+ */
 static jmp_buf env;
 static volatile sig_atomic_t jmp_ready = false;
 static bool time_limited = false;
 
 /* Internal functions */
 
+static void make_block_lock()
+{
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_ERRORCHECK);
+    pthread_mutex_init(&block_lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
+static void lock_blocks()
+{
+    pthread_once(&block_lock_once, make_block_lock);
+    pthread_mutex_lock(&block_lock);
+}
+
+/* Release block_lock if the calling thread holds it */
+static void unlock_blocks()
+{
+    pthread_once(&block_lock_once, make_block_lock);
+    pthread_mutex_unlock(&block_lock);
+}
+
 /* Should this allocation fail? */
 static bool fail_allocation()
 {
@@ -68,7 +129,7 @@ static bool fail_allocation()
 }
 
 /* Find header of block, given its payload.
- * Signal error if doesn't seem like legitimate block
+ * Signal error if doesn't seem like legitimate block.
  */
 static block_element_t *find_header(void *p)
 {
@@ -81,12 +142,14 @@ static block_element_t *find_header(void *p)
         (block_element_t *) ((size_t) p - sizeof(block_element_t));
     if (cautious_mode) {
         /* Make sure this is really an allocated block */
+        lock_blocks();
         block_element_t *ab = allocated;
         bool found = false;
         while (ab && !found) {
             found = ab == b;
             ab = ab->next;
         }
+        unlock_blocks();
         if (!found) {
             report_event(MSG_ERROR,
                          "Attempted to free unallocated block.  Address = %p",
@@ -115,6 +178,76 @@ static size_t *find_footer(block_element_t *b)
     return p;
 }
 
+/* Size class used by the per-thread cache, or -1 if not cacheable */
+static inline int cache_class(size_t size)
+{
+    if (!CACHE_DEPTH || size > CACHE_MAX_SIZE)
+        return -1;
+    return (size + CACHE_GRANULE - 1) / CACHE_GRANULE;
+}
+
+/* Release every block cached by the calling thread */
+void release_thread_cache()
+{
+    for (int c = 0; c < CACHE_CLASSES; c++) {
+        block_element_t *b = free_cache[c];
+        while (b) {
+            block_element_t *next = b->next;
+            free(b);
+            b = next;
+        }
+        free_cache[c] = NULL;
+        free_cache_cnt[c] = 0;
+    }
+}
+
+static void cache_destructor(void *arg)
+{
+    release_thread_cache();
+}
+
+static void make_cache_key()
+{
+    pthread_key_create(&cache_key, cache_destructor);
+}
+
+/* Get raw storage for a block with given payload size */
+static block_element_t *get_block(size_t size)
+{
+    int c = cache_class(size);
+    if (c >= 0 && free_cache[c]) {
+        block_element_t *b = free_cache[c];
+        free_cache[c] = b->next;
+        free_cache_cnt[c]--;
+        return b;
+    }
+
+    /* Round cacheable blocks up so that they can be reused by any request
+     * falling into the same class.
+     */
+    size_t capacity = c >= 0 ? (size_t) c * CACHE_GRANULE : size;
+    return malloc(capacity + sizeof(block_element_t) + sizeof(size_t));
+}
+
+/* Return storage of a released block */
+static void put_block(block_element_t *b)
+{
+    int c = cache_class(b->payload_size);
+    if (c < 0 || free_cache_cnt[c] >= CACHE_DEPTH) {
+        free(b);
+        return;
+    }
+
+    if (!free_cache_cnt[c]) {
+        /* Make sure the cache is drained once this thread terminates */
+        pthread_once(&cache_key_once, make_cache_key);
+        pthread_setspecific(cache_key, (void *) 1);
+    }
+    b->next = free_cache[c];
+    free_cache[c] = b;
+    free_cache_cnt[c]++;
+}
+
 /* Implementation of application functions */
 
 void *test_malloc(size_t size)
@@ -129,8 +262,7 @@ void *test_malloc(size_t size)
         return NULL;
     }
 
-    block_element_t *new_block =
-        malloc(size + sizeof(block_element_t) + sizeof(size_t));
+    block_element_t *new_block = get_block(size);
     if (!new_block) {
         report_event(MSG_FATAL, "Couldn't allocate any more memory");
         error_occurred = true;
@@ -143,6 +275,8 @@ void *test_malloc(size_t size)
     *find_footer(new_block) = MAGICFOOTER;
     void *p = (void *) &new_block->payload;
     memset(p, FILLCHAR, size);
+
+    lock_blocks();
     // cppcheck-suppress nullPointerRedundantCheck
     new_block->next = allocated;
     // cppcheck-suppress nullPointerRedundantCheck
@@ -151,7 +285,10 @@ void *test_malloc(size_t size)
     if (allocated)
         allocated->prev = new_block;
     allocated = new_block;
+    unlock_blocks();
     allocated_count++;
+    thread_alloc_cnt++;
+    thread_alloc_bytes += size;
 
     return p;
 }
@@ -178,6 +315,9 @@ void test_free(void *p)
     if (!p)
         return;
 
+    /* The caller's pointer is checked without holding the lock, as a bad
+     * one raises a signal.
+     */
     block_element_t *b = find_header(p);
     size_t footer = *find_footer(b);
     if (footer != MAGICFOOTER) {
@@ -187,9 +327,25 @@ void test_free(void *p)
                      p);
         error_occurred = true;
     }
+
+    /* Marking and unlinking must be atomic, or two threads releasing the
+     * same block could both succeed.
+     */
+    size_t header = b->magic_header;
+    lock_blocks();
+    if (b->magic_header == MAGICFREE) {
+        /* Released already, by another thread if it was not when checked */
+        unlock_blocks();
+        if (header != MAGICFREE)
+            report_event(MSG_ERROR,
+                         "Attempted to free unallocated or corrupted block.  "
+                         "Address = %p",
+                         p);
+        error_occurred = true;
+        return;
+    }
     b->magic_header = MAGICFREE;
     *find_footer(b) = MAGICFREE;
-    memset(p, FILLCHAR, b->payload_size);
 
     /* Unlink from list */
     block_element_t *bn = b->next;
@@ -200,9 +356,11 @@ void test_free(void *p)
         allocated = bn;
     if (bn)
         bn->prev = bp;
-
-    free(b);
+    unlock_blocks();
     allocated_count--;
+
+    memset(p, FILLCHAR, b->payload_size);
+    put_block(b);
 }
 
 // cppcheck-suppress unusedFunction
@@ -216,11 +374,56 @@ char *test_strdup(const char *s)
     return memcpy(new, s, len);
 }
 
+/* Counter of string comparisons, when counting on this thread */
+static __thread size_t *cmp_counter = NULL;
+
+int test_strcmp(const char *s1, const char *s2)
+{
+    if (cmp_counter)
+        (*cmp_counter)++;
+    return strcmp(s1, s2);
+}
+
+void count_comparisons(size_t *counter)
+{
+    cmp_counter = counter;
+}
+
 size_t allocation_check()
 {
     return allocated_count;
 }
 
+void allocation_totals(size_t *cnt, size_t *bytes)
+{
+    *cnt = thread_alloc_cnt;
+    *bytes = thread_alloc_bytes;
+}
+
+/* Newest block, as blocks are pushed at the head of the list */
+void *allocation_mark()
+{
+    lock_blocks();
+    void *mark = allocated;
+    unlock_blocks();
+    return mark;
+}
+
+void allocation_release(void *mark)
+{
+    lock_blocks();
+    while (allocated && allocated != mark) {
+        block_element_t *b = allocated;
+        allocated = b->next;
+        b->magic_header = MAGICFREE;
+        allocated_count--;
+        free(b);
+    }
+    if (allocated)
+        allocated->prev = NULL;
+    unlock_blocks();
+}
+
 /* Implementation of functions for testing */
 
 /* Set/unset cautious mode.
@@ -242,9 +445,7 @@ void set_noallocate_mode(bool noallocate)
 /* Return whether any errors have occurred since last time set error limit */
 bool error_check()
 {
-    bool e = error_occurred;
-    error_occurred = false;
-    return e;
+    return atomic_exchange(&error_occurred, false);
 }
 
 /* Prepare for a risky operation using setjmp.
@@ -253,7 +454,8 @@ bool error_check()
 bool exception_setup(bool limit_time)
 {
     if (sigsetjmp(env, 1)) {
-        /* Got here from longjmp */
+        /* Got here from longjmp, maybe out of the allocator */
+        unlock_blocks();
         jmp_ready = false;
         if (time_limited) {
             alarm(0);
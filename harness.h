@@ -8,12 +8,17 @@
 /* This test harness enables us to do stringent testing of code.
  * It overloads the library versions of malloc and free with ones that
  * allow checking for common allocation errors.
+ *
+ * test_malloc, test_free and friends may be called concurrently from several
+ * threads.  The exception mechanism below may only be used by the thread
+ * driving the tests.
  */
 
 void *test_malloc(size_t size);
 void *test_calloc(size_t nmemb, size_t size);
 void test_free(void *p);
 char *test_strdup(const char *s);
+int test_strcmp(const char *s1, const char *s2);
 /* FIXME: provide test_realloc as well */
 
 #ifdef INTERNAL
@@ -21,6 +26,28 @@ char *test_strdup(const char *s);
 /* Report number of allocated blocks */
 size_t allocation_check();
 
+/* Count the calls to strcmp made by the tested code on the calling thread
+ * into *counter, or stop counting if counter is NULL.
+ */
+void count_comparisons(size_t *counter);
+
+/* Report number and total size of blocks ever allocated by calling thread */
+void allocation_totals(size_t *cnt, size_t *bytes);
+
+/* Mark the current point of allocation, for allocation_release() */
+void *allocation_mark();
+
+/* Release every block allocated since mark was taken, without walking the
+ * structures holding them.  Blocks allocated before the mark must not have
+ * been freed in between.
+ */
+void allocation_release(void *mark);
+
+/* Return blocks cached by the calling thread to the system allocator.
+ * Called automatically when a thread exits.
+ */
+void release_thread_cache();
+
 /* Probability of malloc failing, expressed as percent */
 extern int fail_probability;
 
@@ -61,6 +88,10 @@ void trigger_exception(char *msg);
 #undef strdup
 #define strdup test_strdup
 
+/* Counted, so that sorts can be compared whatever their implementation */
+#undef strcmp
+#define strcmp test_strcmp
+
 #endif
 
 #endif /* LAB0_HARNESS_H */
@@ -8,6 +8,8 @@
 // #include <linux/list.h>
 #include "list_sort.h"
 
+sort_counter_t *sort_counter = NULL;
+
 int cmp(void *_, const struct list_head *a, const struct list_head *b)
 {
     char *strA = list_entry(a, element_t, list)->value;
@@ -25,8 +27,10 @@ merge(void *priv, list_cmp_func_t cmp, struct list_head *a, struct list_head *b)
 {
     // cppcheck-suppress unassignedVariable
     struct list_head *head, **tail = &head;
+    size_t visits = 0;
 
     for (;;) {
+        visits++;
         /* if equal, take 'a' -- important for sort stability */
         if (cmp(priv, a, b) <= 0) {
             *tail = a;
@@ -46,6 +50,8 @@ merge(void *priv, list_cmp_func_t cmp, struct list_head *a, struct list_head *b)
             }
         }
     }
+    sort_count(visits, visits);
+    sort_count(merges, 1);
     return head;
 }
 
@@ -65,8 +71,10 @@ __attribute__((nonnull(2, 3, 4, 5))) static void merge_final(
 {
     struct list_head *tail = head;
     u8 count = 0;
+    size_t visits = 0;
 
     for (;;) {
+        visits++;
         /* if equal, take 'a' -- important for sort stability */
         if (cmp(priv, a, b) <= 0) {
             tail->next = a;
@@ -99,6 +107,7 @@ __attribute__((nonnull(2, 3, 4, 5))) static void merge_final(
          */
         if (unlikely(!++count))
             cmp(priv, b, b);
+        visits++;
         b->prev = tail;
         tail = b;
         b = b->next;
@@ -107,6 +116,8 @@ __attribute__((nonnull(2, 3, 4, 5))) static void merge_final(
     /* And the final links to make a circular doubly-linked list */
     tail->next = head;
     head->prev = tail;
+    sort_count(visits, visits);
+    sort_count(merges, 1);
 }
 
 /**
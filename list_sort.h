@@ -30,4 +30,26 @@ int cmp(void *_, const struct list_head *a, const struct list_head *b);
 #define likely(x) __builtin_expect(!!(x), 1)
 #define unlikely(x) __builtin_expect(!!(x), 0)
 
+/* Work done by a sort.
+ * cmps counts string comparisons, through the harness's strcmp, and so is
+ * measured the same way for any implementation.  visits and merges are
+ * only charged by list_sort(): a visit is a node that a merge takes from
+ * one of its input runs, either by a comparison or while walking the rest
+ * of a run to rebuild prev links, and a merge joins two sorted runs.
+ */
+typedef struct {
+    size_t cmps;
+    size_t visits;
+    size_t merges;
+} sort_counter_t;
+
+/* Counter charged by list_sort(), or NULL when nothing is being counted */
+extern sort_counter_t *sort_counter;
+
+#define sort_count(field, n)            \
+    do {                                \
+        if (sort_counter)               \
+            sort_counter->field += (n); \
+    } while (0)
+
 #endif
\ No newline at end of file
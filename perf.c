@@ -0,0 +1,128 @@
+/* Hardware performance counters through perf_event_open(2) */
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+#include "perf.h"
+
+const char *perf_event_names[PERF_EVENTS] = {
+    "cycles",
+    "instructions",
+    "cache-misses",
+    "branch-misses",
+};
+
+#if defined(__linux__)
+
+static const uint64_t perf_event_config[PERF_EVENTS] = {
+    PERF_COUNT_HW_CPU_CYCLES,
+    PERF_COUNT_HW_INSTRUCTIONS,
+    PERF_COUNT_HW_CACHE_MISSES,
+    PERF_COUNT_HW_BRANCH_MISSES,
+};
+
+/* Layout of data read from a counter opened with the format below */
+struct perf_reading {
+    uint64_t value;
+    uint64_t time_enabled;
+    uint64_t time_running;
+};
+
+bool perf_open(perf_counters_t *pc)
+{
+    int err = 0;
+    bool any = false;
+    for (int i = 0; i < PERF_EVENTS; i++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = perf_event_config[i];
+        attr.disabled = 1;
+        attr.inherit = 1;
+        /* User space only, which does not need privileges by default */
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format =
+            PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+        pc->fd[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        if (pc->fd[i] < 0) {
+            pc->fd[i] = -1;
+            err = errno;
+        } else {
+            any = true;
+        }
+    }
+
+    if (!any)
+        errno = err;
+    return any;
+}
+
+void perf_start(perf_counters_t *pc)
+{
+    for (int i = 0; i < PERF_EVENTS; i++) {
+        if (pc->fd[i] < 0)
+            continue;
+        ioctl(pc->fd[i], PERF_EVENT_IOC_RESET, 0);
+        ioctl(pc->fd[i], PERF_EVENT_IOC_ENABLE, 0);
+    }
+}
+
+void perf_stop(perf_counters_t *pc, int64_t counts[PERF_EVENTS])
+{
+    for (int i = 0; i < PERF_EVENTS; i++) {
+        if (pc->fd[i] >= 0)
+            ioctl(pc->fd[i], PERF_EVENT_IOC_DISABLE, 0);
+    }
+
+    for (int i = 0; i < PERF_EVENTS; i++) {
+        struct perf_reading r;
+        counts[i] = -1;
+        if (pc->fd[i] < 0 || read(pc->fd[i], &r, sizeof(r)) != sizeof(r))
+            continue;
+        if (!r.time_running)
+            continue;
+        double scale = (double) r.time_enabled / r.time_running;
+        counts[i] = (int64_t) (r.value * scale);
+    }
+}
+
+void perf_close(perf_counters_t *pc)
+{
+    for (int i = 0; i < PERF_EVENTS; i++) {
+        if (pc->fd[i] >= 0)
+            close(pc->fd[i]);
+        pc->fd[i] = -1;
+    }
+}
+
+#else /* !defined(__linux__) */
+
+bool perf_open(perf_counters_t *pc)
+{
+    for (int i = 0; i < PERF_EVENTS; i++)
+        pc->fd[i] = -1;
+    errno = ENOSYS;
+    return false;
+}
+
+void perf_start(perf_counters_t *pc) {}
+
+void perf_stop(perf_counters_t *pc, int64_t counts[PERF_EVENTS])
+{
+    for (int i = 0; i < PERF_EVENTS; i++)
+        counts[i] = -1;
+}
+
+void perf_close(perf_counters_t *pc) {}
+
+#endif /* defined(__linux__) */
@@ -0,0 +1,37 @@
+#ifndef LAB0_PERF_H
+#define LAB0_PERF_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Hardware events counted by perf_event_open(2) */
+typedef enum {
+    PERF_CYCLES,
+    PERF_INSTRUCTIONS,
+    PERF_CACHE_MISSES,
+    PERF_BRANCH_MISSES,
+    PERF_EVENTS
+} perf_event_t;
+
+extern const char *perf_event_names[PERF_EVENTS];
+
+/* Open counters of the calling thread and the threads it creates */
+typedef struct {
+    int fd[PERF_EVENTS]; /* -1 for events that could not be opened */
+} perf_counters_t;
+
+/* Open all counters.  Return false, with errno set, if none is available */
+bool perf_open(perf_counters_t *pc);
+
+/* Reset counters and start counting */
+void perf_start(perf_counters_t *pc);
+
+/* Stop counting and store the count of each event, or -1 if the event
+ * is not available.  Counts are scaled up if the kernel had to multiplex
+ * the counters.
+ */
+void perf_stop(perf_counters_t *pc, int64_t counts[PERF_EVENTS]);
+
+void perf_close(perf_counters_t *pc);
+
+#endif /* LAB0_PERF_H */
@@ -0,0 +1,548 @@
+/* Microbenchmarks for the operations of queue.h
+ *
+ * Every operation is run on queues of several sizes filled with keys from
+ * several distributions.  Setup and teardown are not timed.  Results are
+ * the median over a number of repetitions, in nanoseconds and allocated
+ * bytes per operation.  Insertions and removals count one operation per
+ * element, the others one per call.  An operation that crashes or runs
+ * for more than TIME_LIMIT seconds is reported as failed.
+ */
+
+#include <getopt.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/* Our program needs to use regular malloc/free */
+#define INTERNAL 1
+#include "harness.h"
+
+#include "list_sort.h"
+#include "queue.h"
+#include "report.h"
+#include "shuffle.h"
+
+#define KEY_LEN 12
+#define MAXSIZES 16
+#define MAXRESULTS 1024
+#define REVERSE_K 3
+#define TIME_LIMIT 10 /* Seconds for all repetitions of a measurement */
+
+/* Keys of the queue being measured */
+static char *keys;
+static int nkeys;
+
+/* Chain of two queues for merge */
+static struct list_head chain;
+static queue_contex_t merge_ctx[2];
+
+static char *key(int i)
+{
+    return keys + (size_t) i * KEY_LEN;
+}
+
+static struct list_head *setup_empty()
+{
+    return q_new();
+}
+
+static struct list_head *setup_filled()
+{
+    struct list_head *q = q_new();
+    for (int i = 0; i < nkeys; i++)
+        q_insert_tail(q, key(i));
+    return q;
+}
+
+static struct list_head *setup_sorted()
+{
+    struct list_head *q = setup_filled();
+    q_sort(q);
+    return q;
+}
+
+/* Two sorted queues, holding the even and odd keys */
+static struct list_head *setup_merge()
+{
+    INIT_LIST_HEAD(&chain);
+    for (int i = 0; i < 2; i++) {
+        queue_contex_t *ctx = &merge_ctx[i];
+        ctx->q = q_new();
+        ctx->id = i;
+        for (int j = i; j < nkeys; j += 2)
+            q_insert_tail(ctx->q, key(j));
+        q_sort(ctx->q);
+        ctx->size = q_size(ctx->q);
+        list_add_tail(&ctx->chain, &chain);
+    }
+    return &chain;
+}
+
+static void teardown_queue(struct list_head *q)
+{
+    q_free(q);
+}
+
+static void teardown_merge(struct list_head *q)
+{
+    for (int i = 0; i < 2; i++)
+        q_free(merge_ctx[i].q);
+}
+
+static void run_insert_head(struct list_head *q)
+{
+    for (int i = 0; i < nkeys; i++)
+        q_insert_head(q, key(i));
+}
+
+static void run_insert_tail(struct list_head *q)
+{
+    for (int i = 0; i < nkeys; i++)
+        q_insert_tail(q, key(i));
+}
+
+static void run_remove_head(struct list_head *q)
+{
+    char buf[KEY_LEN];
+    for (int i = 0; i < nkeys; i++)
+        q_release_element(q_remove_head(q, buf, sizeof(buf)));
+}
+
+static void run_remove_tail(struct list_head *q)
+{
+    char buf[KEY_LEN];
+    for (int i = 0; i < nkeys; i++)
+        q_release_element(q_remove_tail(q, buf, sizeof(buf)));
+}
+
+static void run_size(struct list_head *q)
+{
+    q_size(q);
+}
+
+static void run_reverse(struct list_head *q)
+{
+    q_reverse(q);
+}
+
+static void run_reverseK(struct list_head *q)
+{
+    q_reverseK(q, REVERSE_K);
+}
+
+static void run_swap(struct list_head *q)
+{
+    q_swap(q);
+}
+
+static void run_sort(struct list_head *q)
+{
+    q_sort(q);
+}
+
+static void run_list_sort(struct list_head *q)
+{
+    list_sort(NULL, q, cmp);
+}
+
+static void run_merge(struct list_head *q)
+{
+    q_merge(q);
+}
+
+static void run_descend(struct list_head *q)
+{
+    q_descend(q);
+}
+
+static void run_dedup(struct list_head *q)
+{
+    q_delete_dup(q);
+}
+
+static void run_shuffle(struct list_head *q)
+{
+    q_shuffle(q);
+}
+
+typedef struct {
+    char *name;
+    bool per_elem; /* One operation per key rather than per call */
+    struct list_head *(*setup)();
+    void (*run)(struct list_head *q);
+    void (*teardown)(struct list_head *q);
+} bench_op_t;
+
+static bench_op_t ops[] = {
+    {"insert_head", true, setup_empty, run_insert_head, teardown_queue},
+    {"insert_tail", true, setup_empty, run_insert_tail, teardown_queue},
+    {"remove_head", true, setup_filled, run_remove_head, teardown_queue},
+    {"remove_tail", true, setup_filled, run_remove_tail, teardown_queue},
+    {"size", false, setup_filled, run_size, teardown_queue},
+    {"reverse", false, setup_filled, run_reverse, teardown_queue},
+    {"reverseK", false, setup_filled, run_reverseK, teardown_queue},
+    {"swap", false, setup_filled, run_swap, teardown_queue},
+    {"sort", false, setup_filled, run_sort, teardown_queue},
+    {"list_sort", false, setup_filled, run_list_sort, teardown_queue},
+    {"merge", false, setup_merge, run_merge, teardown_merge},
+    {"descend", false, setup_filled, run_descend, teardown_queue},
+    {"dedup", false, setup_sorted, run_dedup, teardown_queue},
+    {"shuffle", false, setup_filled, run_shuffle, teardown_queue},
+};
+
+#define NOPS (sizeof(ops) / sizeof(ops[0]))
+
+typedef enum { DIST_RANDOM, DIST_SORTED, DIST_REVERSE, DIST_FEW } dist_t;
+
+#define NDISTS (DIST_FEW + 1)
+static char *dist_names[NDISTS] = {"random", "sorted", "reverse", "few"};
+
+/* xorshift64, so that runs see the same keys */
+static uint64_t rng_state;
+
+static uint64_t rng_next()
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+static void make_keys(dist_t dist, int n)
+{
+    free(keys);
+    keys = malloc((size_t) n * KEY_LEN);
+    if (!keys) {
+        fprintf(stderr, "Out of memory for %d keys\n", n);
+        exit(EXIT_FAILURE);
+    }
+    nkeys = n;
+
+    rng_state = 88172645463325252ULL;
+    for (int i = 0; i < n; i++) {
+        uint32_t k;
+        switch (dist) {
+        case DIST_SORTED:
+            k = i;
+            break;
+        case DIST_REVERSE:
+            k = n - i;
+            break;
+        case DIST_FEW:
+            k = rng_next() % 8;
+            break;
+        default:
+            k = rng_next() % 1000000000;
+            break;
+        }
+        snprintf(key(i), KEY_LEN, "k%09u", k);
+    }
+}
+
+typedef struct {
+    char op[16];
+    char dist[16];
+    long size;
+    double ns;
+    double bytes;
+    double allocs;
+} result_t;
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+/* Time one run of op */
+static void run_once(bench_op_t *op, int64_t *elapsed, size_t *cnt,
+                     size_t *bytes)
+{
+    size_t cnt0, bytes0, cnt1, bytes1;
+    struct list_head *q = op->setup();
+    allocation_totals(&cnt0, &bytes0);
+    int64_t start = monotonic_ns();
+    op->run(q);
+    *elapsed = monotonic_ns() - start;
+    allocation_totals(&cnt1, &bytes1);
+    op->teardown(q);
+    *cnt = cnt1 - cnt0;
+    *bytes = bytes1 - bytes0;
+}
+
+/* Child side of measure: all repetitions, result written to fd */
+static void measure_child(bench_op_t *op, int reps, result_t *res, int fd)
+{
+    double *samples = malloc(reps * sizeof(double));
+    size_t cnt = 0, bytes = 0;
+
+    alarm(TIME_LIMIT);
+    for (int r = 0; r < reps; r++) {
+        int64_t elapsed;
+        run_once(op, &elapsed, &cnt, &bytes);
+        samples[r] = elapsed;
+    }
+    qsort(samples, reps, sizeof(double), cmp_double);
+
+    double div = op->per_elem && nkeys ? nkeys : 1;
+    res->ns = samples[reps / 2] / div;
+    res->bytes = bytes / div;
+    res->allocs = cnt / div;
+    free(samples);
+
+    if (write(fd, res, sizeof(result_t)) != sizeof(result_t))
+        _exit(EXIT_FAILURE);
+    _exit(EXIT_SUCCESS);
+}
+
+/* Each measurement runs in a child process, so that a crashing or looping
+ * queue implementation only loses its own results.  Returns false, with
+ * the reason in *why, if there are no results.
+ */
+static bool measure(bench_op_t *op, int reps, result_t *res, char **why)
+{
+    int fds[2];
+    if (pipe(fds) < 0) {
+        *why = "pipe failed";
+        return false;
+    }
+
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+        close(fds[0]);
+        close(fds[1]);
+        *why = "fork failed";
+        return false;
+    }
+    if (pid == 0) {
+        close(fds[0]);
+        measure_child(op, reps, res, fds[1]);
+    }
+
+    close(fds[1]);
+    bool ok = read(fds[0], res, sizeof(result_t)) == sizeof(result_t);
+    close(fds[0]);
+
+    int status;
+    waitpid(pid, &status, 0);
+    if (!ok) {
+        if (WIFSIGNALED(status) && WTERMSIG(status) == SIGALRM)
+            *why = "time limit exceeded";
+        else if (WIFSIGNALED(status))
+            *why = strsignal(WTERMSIG(status));
+        else
+            *why = "failed";
+    }
+    return ok;
+}
+
+/* Results of a previous run, to compare against */
+static result_t base[MAXRESULTS];
+static int nbase = 0;
+
+static void load_baseline(char *fname)
+{
+    FILE *f = fopen(fname, "r");
+    if (!f) {
+        fprintf(stderr, "Cannot open baseline '%s'\n", fname);
+        exit(EXIT_FAILURE);
+    }
+
+    char line[256];
+    while (nbase < MAXRESULTS && fgets(line, sizeof(line), f)) {
+        result_t *r = &base[nbase];
+        if (line[0] == '#')
+            continue;
+        if (sscanf(line, "%15s %15s %ld %lf %lf %lf", r->op, r->dist,
+                   &r->size, &r->ns, &r->bytes, &r->allocs) == 6)
+            nbase++;
+    }
+    fclose(f);
+}
+
+static result_t *find_baseline(result_t *res)
+{
+    for (int i = 0; i < nbase; i++) {
+        if (!strcmp(base[i].op, res->op) && !strcmp(base[i].dist, res->dist) &&
+            base[i].size == res->size)
+            return &base[i];
+    }
+    return NULL;
+}
+
+/* Select the entries of names[] listed in the comma-separated spec */
+static bool parse_list(char *spec, char **names, size_t stride, int n,
+                       bool *sel)
+{
+    memset(sel, 0, n * sizeof(bool));
+    for (char *tok = strtok(spec, ","); tok; tok = strtok(NULL, ",")) {
+        int i;
+        for (i = 0; i < n; i++) {
+            if (!strcmp(tok, *(char **) ((char *) names + i * stride)))
+                break;
+        }
+        if (i == n) {
+            fprintf(stderr, "Unknown name '%s'\n", tok);
+            return false;
+        }
+        sel[i] = true;
+    }
+    return true;
+}
+
+static void usage(char *cmd)
+{
+    printf("Usage: %s [-h] [-n SIZES] [-r REPS] [-p OPS] [-d DISTS]\n"
+           "       [-o OFILE] [-b BFILE] [-t PCT]\n",
+           cmd);
+    printf("\t-h         Print this information\n");
+    printf("\t-n SIZES   Comma-separated queue sizes (default "
+           "1000,10000,100000)\n");
+    printf("\t-r REPS    Repetitions of each measurement (default 5)\n");
+    printf("\t-p OPS     Comma-separated operations (default all)\n");
+    printf("\t-d DISTS   Comma-separated key distributions: random, sorted, "
+           "reverse, few\n");
+    printf("\t-o OFILE   Save results to OFILE\n");
+    printf("\t-b BFILE   Compare results against those saved in BFILE\n");
+    printf("\t-t PCT     Slowdown over baseline reported as regression "
+           "(default 10)\n");
+    exit(0);
+}
+
+int main(int argc, char *argv[])
+{
+    long sizes[MAXSIZES] = {1000, 10000, 100000};
+    int nsizes = 3;
+    int reps = 5;
+    double threshold = 10;
+    bool op_sel[NOPS], dist_sel[NDISTS];
+    char *ofile = NULL;
+
+    memset(op_sel, true, sizeof(op_sel));
+    memset(dist_sel, true, sizeof(dist_sel));
+
+    int c;
+    while ((c = getopt(argc, argv, "hn:r:p:d:o:b:t:")) != -1) {
+        switch (c) {
+        case 'h':
+            usage(argv[0]);
+            break;
+        case 'n':
+            nsizes = 0;
+            for (char *tok = strtok(optarg, ","); tok && nsizes < MAXSIZES;
+                 tok = strtok(NULL, ",")) {
+                sizes[nsizes] = strtol(tok, NULL, 10);
+                if (sizes[nsizes] <= 0 || sizes[nsizes] > INT32_MAX) {
+                    fprintf(stderr, "Invalid size '%s'\n", tok);
+                    exit(EXIT_FAILURE);
+                }
+                nsizes++;
+            }
+            break;
+        case 'r':
+            reps = atoi(optarg);
+            if (reps <= 0) {
+                fprintf(stderr, "Invalid repetition count '%s'\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'p':
+            if (!parse_list(optarg, &ops[0].name, sizeof(bench_op_t), NOPS,
+                            op_sel))
+                exit(EXIT_FAILURE);
+            break;
+        case 'd':
+            if (!parse_list(optarg, dist_names, sizeof(char *), NDISTS,
+                            dist_sel))
+                exit(EXIT_FAILURE);
+            break;
+        case 'o':
+            ofile = optarg;
+            break;
+        case 'b':
+            load_baseline(optarg);
+            break;
+        case 't':
+            threshold = atof(optarg);
+            break;
+        default:
+            printf("Unknown option '%c'\n", c);
+            usage(argv[0]);
+            break;
+        }
+    }
+
+    FILE *out = NULL;
+    if (ofile) {
+        out = fopen(ofile, "w");
+        if (!out) {
+            fprintf(stderr, "Cannot open output file '%s'\n", ofile);
+            exit(EXIT_FAILURE);
+        }
+        fprintf(out, "# op dist size ns/op bytes/op allocs/op\n");
+    }
+
+    /* Freeing must not scan all allocated blocks */
+    set_cautious_mode(false);
+
+    printf("%-12s %-8s %9s %14s %10s %10s%s\n", "op", "dist", "size",
+           "ns/op", "bytes/op", "allocs/op", nbase ? "   vs base" : "");
+
+    int regressions = 0, failures = 0;
+    for (int d = 0; d < NDISTS; d++) {
+        if (!dist_sel[d])
+            continue;
+        for (int s = 0; s < nsizes; s++) {
+            make_keys(d, sizes[s]);
+            for (size_t o = 0; o < NOPS; o++) {
+                if (!op_sel[o])
+                    continue;
+                result_t res;
+                snprintf(res.op, sizeof(res.op), "%s", ops[o].name);
+                snprintf(res.dist, sizeof(res.dist), "%s", dist_names[d]);
+                res.size = sizes[s];
+                char *why;
+                if (!measure(&ops[o], reps, &res, &why)) {
+                    printf("%-12s %-8s %9ld  FAILED: %s\n", ops[o].name,
+                           dist_names[d], sizes[s], why);
+                    failures++;
+                    continue;
+                }
+
+                printf("%-12s %-8s %9ld %14.1f %10.1f %10.2f", res.op,
+                       res.dist, res.size, res.ns, res.bytes, res.allocs);
+                result_t *b = find_baseline(&res);
+                if (b && b->ns > 0) {
+                    double pct = 100 * (res.ns - b->ns) / b->ns;
+                    bool slow = pct > threshold;
+                    regressions += slow;
+                    printf("   %+7.1f%%%s", pct, slow ? "  REGRESSION" : "");
+                }
+                printf("\n");
+                fflush(stdout);
+
+                if (out)
+                    fprintf(out, "%s %s %ld %.1f %.1f %.2f\n", res.op,
+                            res.dist, res.size, res.ns, res.bytes,
+                            res.allocs);
+            }
+        }
+    }
+
+    if (out)
+        fclose(out);
+    free(keys);
+
+    if (failures)
+        printf("%d operation(s) failed\n", failures);
+    if (regressions)
+        printf("%d result(s) more than %.0f%% slower than baseline\n",
+               regressions, threshold);
+    return failures || regressions ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -3,6 +3,7 @@
 #include <assert.h>
 #include <errno.h>
 #include <getopt.h>
+#include <math.h>
 #include <signal.h>
 #include <spawn.h>
 #include <stdio.h>
@@ -560,6 +561,21 @@ static bool do_dedup(int argc, char *argv[])
 
 static bool do_reverse(int argc, char *argv[])
 {
+    if (simulation) {
+        if (argc != 1) {
+            report(1, "%s does not need arguments in simulation mode", argv[0]);
+            return false;
+        }
+        bool ok = is_reverse_const();
+        if (!ok) {
+            report(1,
+                   "ERROR: Probably not constant time or wrong implementation");
+            return false;
+        }
+        report(1, "Probably constant time");
+        return ok;
+    }
+
     if (argc != 1) {
         report(1, "%s takes no arguments", argv[0]);
         return false;
@@ -581,6 +597,21 @@ static bool do_reverse(int argc, char *argv[])
 
 static bool do_size(int argc, char *argv[])
 {
+    if (simulation) {
+        if (argc != 1) {
+            report(1, "%s does not need arguments in simulation mode", argv[0]);
+            return false;
+        }
+        bool ok = is_size_const();
+        if (!ok) {
+            report(1,
+                   "ERROR: Probably not constant time or wrong implementation");
+            return false;
+        }
+        report(1, "Probably constant time");
+        return ok;
+    }
+
     if (argc != 1 && argc != 2) {
         report(1, "%s takes 0-1 arguments", argv[0]);
         return false;
@@ -627,6 +658,28 @@ static bool do_size(int argc, char *argv[])
     return ok && !error_check();
 }
 
+/* Work done by the sort routines during the current command */
+static sort_counter_t sort_work;
+
+static void sort_count_start()
+{
+    memset(&sort_work, 0, sizeof(sort_work));
+    sort_counter = &sort_work;
+    count_comparisons(&sort_work.cmps);
+}
+
+/* Visits and merges are only known for list_sort(), whose code is ours */
+static void sort_count_report(const char *name, bool steps)
+{
+    sort_counter = NULL;
+    count_comparisons(NULL);
+    if (steps)
+        report(2, "%s: %zu comparisons, %zu node visits, %zu merges", name,
+               sort_work.cmps, sort_work.visits, sort_work.merges);
+    else
+        report(2, "%s: %zu comparisons", name, sort_work.cmps);
+}
+
 bool do_sort(int argc, char *argv[])
 {
     if (argc != 1) {
@@ -646,9 +699,11 @@ bool do_sort(int argc, char *argv[])
     error_check();
 
     set_noallocate_mode(true);
+    sort_count_start();
     if (current && exception_setup(true))
         q_sort(current->q);
     exception_cancel();
+    sort_count_report(argv[0], false);
     set_noallocate_mode(false);
 
     bool ok = true;
@@ -674,6 +729,21 @@ bool do_sort(int argc, char *argv[])
 
 static bool do_dm(int argc, char *argv[])
 {
+    if (simulation) {
+        if (argc != 1) {
+            report(1, "%s does not need arguments in simulation mode", argv[0]);
+            return false;
+        }
+        bool ok = is_delete_mid_const();
+        if (!ok) {
+            report(1,
+                   "ERROR: Probably not constant time or wrong implementation");
+            return false;
+        }
+        report(1, "Probably constant time");
+        return ok;
+    }
+
     if (argc != 1) {
         report(1, "%s takes no arguments", argv[0]);
         return false;
@@ -806,9 +876,11 @@ static bool do_merge(int argc, char *argv[])
 
     int len = 0;
     set_noallocate_mode(true);
+    sort_count_start();
     if (current && exception_setup(true))
         len = q_merge(&chain.head);
     exception_cancel();
+    sort_count_report(argv[0], false);
     set_noallocate_mode(false);
 
     if (q_size(&chain.head) > 1) {
@@ -884,9 +956,11 @@ static bool do_list_sort(int argc, char *argv[])
 
     error_check();
     set_noallocate_mode(true);
+    sort_count_start();
     if (exception_setup(true))
         list_sort(NULL, current->q, cmp);
     exception_cancel();
+    sort_count_report(argv[0], true);
 
     set_noallocate_mode(false);
     q_show(3);
@@ -1030,6 +1104,447 @@ static bool do_next(int argc, char *argv[])
     return q_show(0);
 }
 
+/* Copy of the current queue taken by 'bench -r' */
+static char **saved_values = NULL;
+static int saved_size = 0;
+
+static void discard_saved_values()
+{
+    for (int i = 0; i < saved_size; i++)
+        free(saved_values[i]);
+    free(saved_values);
+    saved_values = NULL;
+    saved_size = 0;
+}
+
+static bool save_queue()
+{
+    discard_saved_values();
+    if (!current || !current->q)
+        return true;
+
+    saved_values = malloc(sizeof(char *) * (current->size + 1));
+    if (!saved_values) {
+        report(1, "INTERNAL ERROR.  Could not allocate space for snapshot");
+        return false;
+    }
+
+    element_t *item;
+    list_for_each_entry (item, current->q, list) {
+        if (saved_size == current->size)
+            break;
+        size_t slen = strlen(item->value) + 1;
+        char *value = malloc(slen);
+        if (!value) {
+            report(1, "INTERNAL ERROR.  Could not allocate space for snapshot");
+            discard_saved_values();
+            return false;
+        }
+        saved_values[saved_size++] = memcpy(value, item->value, slen);
+    }
+    return true;
+}
+
+/* Rebuild the current queue from the snapshot.  This is done outside of the
+ * measured region, so allocation failures are turned off meanwhile.
+ */
+static bool restore_queue()
+{
+    if (!current || !saved_values)
+        return true;
+
+    bool ok = true;
+    int old_probability = fail_probability;
+    fail_probability = 0;
+    set_cautious_mode(false);
+    error_check();
+    if (exception_setup(true)) {
+        q_free(current->q);
+        current->q = q_new();
+        for (int i = 0; ok && i < saved_size; i++)
+            ok = q_insert_tail(current->q, saved_values[i]);
+    }
+    exception_cancel();
+    set_cautious_mode(true);
+    fail_probability = old_probability;
+
+    current->size = saved_size;
+    if (!ok)
+        report(1, "ERROR: Could not restore queue contents");
+    return ok && !error_check();
+}
+
+static bool q_state(state_op_t op)
+{
+    switch (op) {
+    case STATE_SAVE:
+        return save_queue();
+    case STATE_RESTORE:
+        return restore_queue();
+    default:
+        discard_saved_values();
+        return true;
+    }
+}
+
+/* Empirical complexity estimation.
+ * An operation is timed on fresh queues of geometrically increasing size,
+ * and the timings of the largest sizes are fitted to t = c * f(n) for each
+ * candidate f.  Smaller sizes are measured but not fitted: while the queue
+ * still fits in some cache level, per-element costs keep rising and would
+ * make linear operations look superlinear.  The fit minimizes the squared
+ * error of log t, since timings span several orders of magnitude.
+ *
+ * Telling n from n log n apart takes more precision than timings offer, so
+ * checking against an expected model only compares growth exponents: the
+ * check fails if timings grow faster than n^k for the local exponent k of
+ * the model, by more than CPLX_SLACK.
+ */
+#define CPLX_MIN_SIZE 256
+#define CPLX_MAX_SIZE (1 << 20)
+#define CPLX_FIT_POINTS 4
+#define CPLX_SAMPLES 3
+#define CPLX_BATCH 256 /* Calls per sample of constant time operations */
+#define CPLX_SLACK 0.5 /* Excess growth exponent tolerated over a model */
+
+typedef struct {
+    char *name;
+    void (*run)(struct list_head *q);
+    bool batch;  /* Time CPLX_BATCH calls instead of one */
+    bool sorted; /* Sort the input before timing */
+} cplx_op_t;
+
+static char cplx_key[MAX_RANDSTR_LEN];
+
+static void cplx_ih(struct list_head *q)
+{
+    for (int i = 0; i < CPLX_BATCH; i++)
+        q_insert_head(q, cplx_key);
+}
+
+static void cplx_it(struct list_head *q)
+{
+    for (int i = 0; i < CPLX_BATCH; i++)
+        q_insert_tail(q, cplx_key);
+}
+
+static void cplx_rh(struct list_head *q)
+{
+    for (int i = 0; i < CPLX_BATCH; i++)
+        q_release_element(q_remove_head(q, NULL, 0));
+}
+
+static void cplx_rt(struct list_head *q)
+{
+    for (int i = 0; i < CPLX_BATCH; i++)
+        q_release_element(q_remove_tail(q, NULL, 0));
+}
+
+static void cplx_size(struct list_head *q)
+{
+    q_size(q);
+}
+
+static void cplx_reverse(struct list_head *q)
+{
+    q_reverse(q);
+}
+
+static void cplx_reverseK(struct list_head *q)
+{
+    q_reverseK(q, 3);
+}
+
+static void cplx_swap(struct list_head *q)
+{
+    q_swap(q);
+}
+
+static void cplx_sort(struct list_head *q)
+{
+    q_sort(q);
+}
+
+static void cplx_list_sort(struct list_head *q)
+{
+    list_sort(NULL, q, cmp);
+}
+
+static void cplx_descend(struct list_head *q)
+{
+    q_descend(q);
+}
+
+static void cplx_dedup(struct list_head *q)
+{
+    q_delete_dup(q);
+}
+
+static void cplx_shuffle(struct list_head *q)
+{
+    q_shuffle(q);
+}
+
+static void cplx_dm(struct list_head *q)
+{
+    q_delete_mid(q);
+}
+
+static const cplx_op_t cplx_ops[] = {
+    {"ih", cplx_ih, true, false},
+    {"it", cplx_it, true, false},
+    {"rh", cplx_rh, true, false},
+    {"rt", cplx_rt, true, false},
+    {"size", cplx_size, false, false},
+    {"reverse", cplx_reverse, false, false},
+    {"reverseK", cplx_reverseK, false, false},
+    {"swap", cplx_swap, false, false},
+    {"sort", cplx_sort, false, false},
+    {"list_sort", cplx_list_sort, false, false},
+    {"descend", cplx_descend, false, false},
+    {"dedup", cplx_dedup, false, true},
+    {"shuffle", cplx_shuffle, false, false},
+    {"dm", cplx_dm, false, false},
+};
+
+#define N_CPLX_OPS (sizeof(cplx_ops) / sizeof(cplx_ops[0]))
+
+typedef enum {
+    MODEL_1,
+    MODEL_LOGN,
+    MODEL_N,
+    MODEL_NLOGN,
+    MODEL_N2,
+    N_MODELS,
+} model_t;
+
+static const char *model_names[N_MODELS] = {"1", "logn", "n", "nlogn", "n2"};
+
+static double model_value(model_t m, double n)
+{
+    switch (m) {
+    case MODEL_LOGN:
+        return log2(n);
+    case MODEL_N:
+        return n;
+    case MODEL_NLOGN:
+        return n * log2(n);
+    case MODEL_N2:
+        return n * n;
+    default:
+        return 1;
+    }
+}
+
+/* Exponent k of f(n) ~ n^k around size n */
+static double model_exponent(model_t m, double n)
+{
+    switch (m) {
+    case MODEL_LOGN:
+        return 1 / log(n);
+    case MODEL_N:
+        return 1;
+    case MODEL_NLOGN:
+        return 1 + 1 / log(n);
+    case MODEL_N2:
+        return 2;
+    default:
+        return 0;
+    }
+}
+
+/* Slope of log t against log n */
+static double growth_exponent(int cnt, const double *n, const double *t)
+{
+    double sx = 0, sy = 0, sxx = 0, sxy = 0;
+    for (int i = 0; i < cnt; i++) {
+        double x = log(n[i]), y = log(t[i]);
+        sx += x;
+        sy += y;
+        sxx += x * x;
+        sxy += x * y;
+    }
+    return (cnt * sxy - sx * sy) / (cnt * sxx - sx * sx);
+}
+
+/* Fit log t = log c + log f(n).  Returns the residual sum of squares. */
+static double fit_model(model_t m, int cnt, const double *n, const double *t)
+{
+    double mean = 0;
+    for (int i = 0; i < cnt; i++)
+        mean += log(t[i] / model_value(m, n[i]));
+    mean /= cnt;
+
+    double rss = 0;
+    for (int i = 0; i < cnt; i++) {
+        double r = log(t[i] / model_value(m, n[i])) - mean;
+        rss += r * r;
+    }
+    return rss;
+}
+
+/* Build a queue of n random strings, without timing it */
+static struct list_head *cplx_queue(int n, bool sorted)
+{
+    struct list_head *q = q_new();
+    char buf[MAX_RANDSTR_LEN];
+    for (int i = 0; q && i < n; i++) {
+        snprintf(buf, sizeof(buf), "%08x", (unsigned) rand());
+        if (!q_insert_tail(q, buf))
+            break;
+    }
+    if (q && sorted)
+        q_sort(q);
+    return q;
+}
+
+/* Minimum time of CPLX_SAMPLES runs at size n, or -1 on failure */
+static double cplx_time(const cplx_op_t *op, int n)
+{
+    double best = -1;
+    for (int s = 0; s < CPLX_SAMPLES; s++) {
+        void *mark = allocation_mark();
+        struct list_head *q = cplx_queue(n, op->sorted);
+        if (!q)
+            return -1;
+
+        int64_t start = monotonic_ns();
+        if (exception_setup(true))
+            op->run(q);
+        exception_cancel();
+        double elapsed = monotonic_ns() - start;
+
+        if (error_check()) {
+            /* A queue left behind by a failed operation may be corrupted;
+             * drop its blocks directly if it cannot be freed.
+             */
+            set_noallocate_mode(false);
+            bool freed = false;
+            if (exception_setup(true)) {
+                q_free(q);
+                freed = !error_check();
+            }
+            exception_cancel();
+            if (!freed)
+                allocation_release(mark);
+            error_check();
+            return -1;
+        }
+        q_free(q);
+
+        if (op->batch)
+            elapsed /= CPLX_BATCH;
+        if (best < 0 || elapsed < best)
+            best = elapsed;
+    }
+    return best > 0 ? best : 1;
+}
+
+static bool do_complexity(int argc, char *argv[])
+{
+    if (argc < 2 || argc > 4) {
+        report(1, "Usage: %s op [model [seconds]]", argv[0]);
+        return false;
+    }
+
+    const cplx_op_t *op = NULL;
+    for (size_t i = 0; i < N_CPLX_OPS; i++) {
+        if (!strcmp(argv[1], cplx_ops[i].name))
+            op = &cplx_ops[i];
+    }
+    if (!op) {
+        report(1, "Unknown operation '%s'", argv[1]);
+        return false;
+    }
+
+    int expected = -1;
+    if (argc >= 3) {
+        for (int m = 0; m < N_MODELS; m++) {
+            if (!strcmp(argv[2], model_names[m]))
+                expected = m;
+        }
+        if (expected < 0) {
+            report(1, "Unknown model '%s', expected 1, logn, n, nlogn or n2",
+                   argv[2]);
+            return false;
+        }
+    }
+
+    int seconds = 5;
+    if (argc == 4 && (!get_int(argv[3], &seconds) || seconds <= 0)) {
+        report(1, "Invalid time limit '%s'", argv[3]);
+        return false;
+    }
+
+    snprintf(cplx_key, sizeof(cplx_key), "dolphin");
+    int old_probability = fail_probability;
+    fail_probability = 0;
+    set_cautious_mode(false);
+    error_check();
+
+    /* Double the size until out of time, memory or patience */
+    double n[32], t[32];
+    int cnt = 0;
+    int64_t deadline = monotonic_ns() + (int64_t) seconds * 1000000000;
+    for (int size = CPLX_MIN_SIZE; size <= CPLX_MAX_SIZE; size *= 2) {
+        int64_t start = monotonic_ns();
+        double elapsed = cplx_time(op, size);
+        if (elapsed < 0) {
+            report(1, "%s failed at size %d", op->name, size);
+            break;
+        }
+        n[cnt] = size;
+        t[cnt++] = elapsed;
+        report(2, "%9d %14.0f ns", size, elapsed);
+
+        /* Stop if the next, larger, size would likely overrun */
+        int64_t now = monotonic_ns();
+        if (now + 2 * (now - start) > deadline)
+            break;
+    }
+
+    set_cautious_mode(true);
+    fail_probability = old_probability;
+
+    if (cnt < CPLX_FIT_POINTS) {
+        report(1, "Too few sizes measured to estimate complexity");
+        return false;
+    }
+
+    int first = cnt - CPLX_FIT_POINTS;
+    double rss[N_MODELS];
+    int best = MODEL_1;
+    for (int m = 0; m < N_MODELS; m++) {
+        rss[m] = fit_model(m, CPLX_FIT_POINTS, n + first, t + first);
+        if (rss[m] < rss[best])
+            best = m;
+    }
+
+    double runner_up = -1;
+    for (int m = 0; m < N_MODELS; m++) {
+        if (m != best && (runner_up < 0 || rss[m] < runner_up))
+            runner_up = rss[m];
+    }
+    double confidence = runner_up > 0 ? 1 - rss[best] / runner_up : 1;
+
+    double growth = growth_exponent(CPLX_FIT_POINTS, n + first, t + first);
+    report(1, "%s: O(%s) over sizes %d..%d, growth n^%.2f, confidence %.0f%%",
+           op->name, model_names[best], (int) n[first], (int) n[cnt - 1],
+           growth, 100 * confidence);
+    for (int m = 0; m < N_MODELS; m++)
+        report(2, "  O(%s)\trms log error %.3f", model_names[m],
+               sqrt(rss[m] / CPLX_FIT_POINTS));
+
+    double center = sqrt(n[first] * n[cnt - 1]);
+    if (expected >= 0 &&
+        growth > model_exponent(expected, center) + CPLX_SLACK) {
+        report(1, "ERROR: Grows faster than expected O(%s)",
+               model_names[expected]);
+        return false;
+    }
+    return true;
+}
+
 static void console_init()
 {
     ADD_COMMAND(new, "Create new queue", "");
@@ -1070,8 +1585,21 @@ static void console_init()
                 "Shuffle the queue with Fisher–Yates shuffle algorithm", "");
     ADD_COMMAND(list_sort, "Sort queue in ascending order with kernel sort",
                 "");
+    ADD_COMMAND(complexity,
+                "Estimate the complexity of op from timings at growing sizes. "
+                "Fail if it grows faster than model (1, logn, n, nlogn, n2)",
+                "op [model [seconds]]");
     add_param("length", &string_length, "Maximum length of displayed string",
               NULL);
+    add_param("threads", &dudect_threads,
+              "Number of threads measuring in simulation mode", NULL);
+    add_param("stable", &dudect_stable,
+              "Pin, serialize cycle counts and warm up in simulation mode",
+              NULL);
+    add_param("sequential", &dudect_sequential,
+              "Stop measuring as soon as the verdict is clear in simulation "
+              "mode",
+              NULL);
     add_param("malloc", &fail_probability, "Malloc failure probability percent",
               NULL);
     add_param("fail", &fail_limit,
@@ -1139,11 +1667,12 @@ static bool q_quit(int argc, char *argv[])
 
 static void usage(char *cmd)
 {
-    printf("Usage: %s [-h] [-f IFILE][-v VLEVEL][-l LFILE]\n", cmd);
+    printf("Usage: %s [-h] [-f IFILE][-v VLEVEL][-l LFILE][-j JFILE]\n", cmd);
     printf("\t-h         Print this information\n");
     printf("\t-f IFILE   Read commands from IFILE\n");
     printf("\t-v VLEVEL  Set verbosity level\n");
     printf("\t-l LFILE   Echo results to LFILE\n");
+    printf("\t-j JFILE   Write per-command results to JFILE as JSON lines\n");
     exit(0);
 }
 
@@ -1211,10 +1740,11 @@ int main(int argc, char *argv[])
     char *infile_name = NULL;
     char lbuf[BUFSIZE];
     char *logfile_name = NULL;
+    char *jsonfile_name = NULL;
     int level = 4;
     int c;
 
-    while ((c = getopt(argc, argv, "hv:f:l:")) != -1) {
+    while ((c = getopt(argc, argv, "hv:f:l:j:")) != -1) {
         switch (c) {
         case 'h':
             usage(argv[0]);
@@ -1239,6 +1769,9 @@ int main(int argc, char *argv[])
             buf[BUFSIZE - 1] = '\0';
             logfile_name = lbuf;
             break;
+        case 'j':
+            jsonfile_name = optarg;
+            break;
         default:
             printf("Unknown option '%c'\n", c);
             usage(argv[0]);
@@ -1269,14 +1802,20 @@ int main(int argc, char *argv[])
         set_echo(true);
     if (logfile_name)
         set_logfile(logfile_name);
+    if (jsonfile_name && !set_jsonfile(jsonfile_name)) {
+        fprintf(stderr, "Couldn't open JSON file '%s'\n", jsonfile_name);
+        exit(EXIT_FAILURE);
+    }
 
     add_quit_helper(q_quit);
+    set_state_helper(q_state);
 
     bool ok = true;
     ok = ok && run_console(infile_name);
 
     /* Do finish_cmd() before check whether ok is true or false */
     ok = finish_cmd() && ok;
+    release_thread_cache();
 
     return !ok;
 }
@@ -1,6 +1,11 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdarg.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -12,11 +17,18 @@
 #include "report.h"
 #include "web.h"
 
+/* Block count of the test harness is part of structured output */
+#define INTERNAL 1
+#include "harness.h"
+
 #define MAX(a, b) ((a) < (b) ? (b) : (a))
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+#define BUF_SIZE 4096
 
 static FILE *errfile = NULL;
 static FILE *verbfile = NULL;
-static FILE *logfile = NULL;
+static FILE *jsonfile = NULL;
 
 int verblevel = 0;
 static void init_files(FILE *efile, FILE *vfile)
@@ -25,6 +37,119 @@ static void init_files(FILE *efile, FILE *vfile)
     verbfile = vfile;
 }
 
+/* The log file stays open until exit and is written by a background thread.
+ * Messages are copied into a ring buffer indexed by two free-running
+ * counters: the producer only advances log_head, the writer only advances
+ * log_tail, so neither side takes a lock on the fast path.  The mutex and
+ * condition variables are only used to put the writer to sleep when the
+ * ring is empty and to wait for it to drain.  Producers are serialized by
+ * log_push_lock, since reports may come from more than one thread.
+ */
+#define LOG_RING_SIZE (1 << 20)
+
+static int log_fd = -1;
+static char log_ring[LOG_RING_SIZE];
+static atomic_size_t log_head = 0;
+static atomic_size_t log_tail = 0;
+static atomic_bool log_idle = false;
+static bool log_stop = false;
+static pthread_t log_thread;
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t log_push_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t log_wake = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t log_drained = PTHREAD_COND_INITIALIZER;
+
+static void *log_writer(void *arg)
+{
+    for (;;) {
+        size_t tail = atomic_load(&log_tail);
+        size_t head = atomic_load(&log_head);
+        if (tail == head) {
+            pthread_mutex_lock(&log_lock);
+            pthread_cond_broadcast(&log_drained);
+            atomic_store(&log_idle, true);
+            while (atomic_load(&log_head) == tail && !log_stop)
+                pthread_cond_wait(&log_wake, &log_lock);
+            atomic_store(&log_idle, false);
+            bool stop = log_stop && atomic_load(&log_head) == tail;
+            pthread_mutex_unlock(&log_lock);
+            if (stop)
+                break;
+            continue;
+        }
+
+        size_t start = tail % LOG_RING_SIZE;
+        size_t n = MIN(head - tail, LOG_RING_SIZE - start);
+        ssize_t w = write(log_fd, log_ring + start, n);
+        if (w < 0 && errno != EINTR)
+            w = n; /* Drop data we cannot write rather than spinning */
+        if (w > 0)
+            atomic_store(&log_tail, tail + w);
+    }
+    return NULL;
+}
+
+static void log_wakeup()
+{
+    if (atomic_load(&log_idle)) {
+        pthread_mutex_lock(&log_lock);
+        pthread_cond_signal(&log_wake);
+        pthread_mutex_unlock(&log_lock);
+    }
+}
+
+/* Wait until the writer has caught up with everything queued so far */
+static void log_flush()
+{
+    if (log_fd < 0)
+        return;
+
+    size_t head = atomic_load(&log_head);
+    pthread_mutex_lock(&log_lock);
+    while ((ptrdiff_t) (head - atomic_load(&log_tail)) > 0) {
+        pthread_cond_signal(&log_wake);
+        pthread_cond_wait(&log_drained, &log_lock);
+    }
+    pthread_mutex_unlock(&log_lock);
+}
+
+static void log_write(const char *buf, size_t len)
+{
+    pthread_mutex_lock(&log_push_lock);
+    while (len) {
+        size_t head = atomic_load(&log_head);
+        size_t space = LOG_RING_SIZE - (head - atomic_load(&log_tail));
+        if (!space) {
+            log_flush();
+            continue;
+        }
+        size_t start = head % LOG_RING_SIZE;
+        size_t n = MIN(MIN(len, space), LOG_RING_SIZE - start);
+        memcpy(log_ring + start, buf, n);
+        atomic_store(&log_head, head + n);
+        buf += n;
+        len -= n;
+    }
+    pthread_mutex_unlock(&log_push_lock);
+    log_wakeup();
+}
+
+static void close_logfile()
+{
+    if (log_fd < 0)
+        return;
+
+    pthread_mutex_lock(&log_lock);
+    log_stop = true;
+    pthread_cond_signal(&log_wake);
+    pthread_mutex_unlock(&log_lock);
+    pthread_join(log_thread, NULL);
+
+    close(log_fd);
+    log_fd = -1;
+    log_stop = false;
+}
+
 static char fail_buf[1024] = "FATAL Error.  Exiting\n";
 
 static volatile int ret = 0;
@@ -32,9 +157,11 @@ static volatile int ret = 0;
 /* Default fatal function */
 static void default_fatal_fun()
 {
+    if (verbfile)
+        fflush(verbfile);
     ret = write(STDOUT_FILENO, fail_buf, strlen(fail_buf) + 1);
-    if (logfile)
-        fputs(fail_buf, logfile);
+    if (log_fd >= 0)
+        log_write(fail_buf, strlen(fail_buf));
 }
 
 /* Optional function to call when fatal error encountered */
@@ -47,8 +174,28 @@ void set_verblevel(int level)
 
 bool set_logfile(char *file_name)
 {
-    logfile = fopen(file_name, "w");
-    return logfile != NULL;
+    static bool registered = false;
+
+    close_logfile();
+    int fd = open(file_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return false;
+
+    log_fd = fd;
+    atomic_store(&log_head, 0);
+    atomic_store(&log_tail, 0);
+    if (pthread_create(&log_thread, NULL, log_writer, NULL)) {
+        close(fd);
+        log_fd = -1;
+        return false;
+    }
+
+    /* Whatever is still queued gets written on the way out */
+    if (!registered) {
+        atexit(close_logfile);
+        registered = true;
+    }
+    return true;
 }
 
 void report_event(message_t msg, char *fmt, ...)
@@ -78,84 +225,112 @@ void report_event(message_t msg, char *fmt, ...)
     fflush(errfile);
     va_end(ap);
 
-    if (logfile) {
+    if (log_fd >= 0) {
+        char buffer[BUF_SIZE];
         va_start(ap, fmt);
-        fprintf(logfile, "Error: ");
-        vfprintf(logfile, fmt, ap);
-        fprintf(logfile, "\n");
-        fflush(logfile);
+        int len = snprintf(buffer, BUF_SIZE, "Error: ");
+        len += vsnprintf(buffer + len, BUF_SIZE - len - 1, fmt, ap);
         va_end(ap);
-        fclose(logfile);
+        if (len > BUF_SIZE - 2)
+            len = BUF_SIZE - 2;
+        buffer[len++] = '\n';
+        log_write(buffer, len);
     }
 
     if (fatal) {
         if (fatal_fun)
             fatal_fun();
+        log_flush();
         exit(1);
     }
 }
 
-#define BUF_SIZE 4096
 extern int web_connfd;
-void report(int level, char *fmt, ...)
-{
-    if (!verbfile)
-        init_files(stdout, stdout);
 
-    char buffer[BUF_SIZE];
-    if (level <= verblevel) {
-        va_list ap;
-        va_start(ap, fmt);
-        vfprintf(verbfile, fmt, ap);
-        fprintf(verbfile, "\n");
-        fflush(verbfile);
-        va_end(ap);
+/* Output for the web client is gathered here and sent by report_flush(), so
+ * that a command answers with a single write instead of one per line.
+ */
+static char web_buf[BUF_SIZE];
+static size_t web_len = 0;
 
-        if (logfile) {
-            va_start(ap, fmt);
-            vfprintf(logfile, fmt, ap);
-            fprintf(logfile, "\n");
-            fflush(logfile);
-            va_end(ap);
-        }
-        va_start(ap, fmt);
-        vsnprintf(buffer, BUF_SIZE, fmt, ap);
-        va_end(ap);
-    }
-    if (web_connfd) {
-        int len = strlen(buffer);
-        buffer[len] = '\n';
-        buffer[len + 1] = '\0';
-        web_send(web_connfd, buffer);
+static void web_flush()
+{
+    if (web_len && web_connfd)
+        web_send(web_connfd, web_buf);
+    web_len = 0;
+}
+
+static void web_append(char *s, size_t len)
+{
+    if (web_len + len >= BUF_SIZE)
+        web_flush();
+    if (len >= BUF_SIZE) {
+        web_send(web_connfd, s);
+        return;
     }
+    memcpy(web_buf + web_len, s, len + 1);
+    web_len += len;
 }
 
-void report_noreturn(int level, char *fmt, ...)
+/* Format a message only if some sink is going to show it.  When the console
+ * is the only sink, print straight into its stdio buffer.  Otherwise format
+ * once and hand the same text to every sink.
+ */
+static void vreport(int level, bool newline, char *fmt, va_list ap)
 {
+    if (level > verblevel)
+        return;
+
     if (!verbfile)
         init_files(stdout, stdout);
 
-    char buffer[BUF_SIZE];
-    if (level <= verblevel) {
-        va_list ap;
-        va_start(ap, fmt);
+    if (log_fd < 0 && !web_connfd) {
         vfprintf(verbfile, fmt, ap);
-        fflush(verbfile);
-        va_end(ap);
-
-        if (logfile) {
-            va_start(ap, fmt);
-            vfprintf(logfile, fmt, ap);
-            fflush(logfile);
-            va_end(ap);
-        }
-        va_start(ap, fmt);
-        vsnprintf(buffer, BUF_SIZE, fmt, ap);
-        va_end(ap);
+        if (newline)
+            fputc('\n', verbfile);
+        return;
     }
 
+    char buffer[BUF_SIZE];
+    int len = vsnprintf(buffer, BUF_SIZE - 1, fmt, ap);
+    if (len < 0)
+        return;
+    if (len > BUF_SIZE - 2)
+        len = BUF_SIZE - 2;
+    if (newline)
+        buffer[len++] = '\n';
+    buffer[len] = '\0';
+
+    fwrite(buffer, 1, len, verbfile);
+    if (log_fd >= 0)
+        log_write(buffer, len);
     if (web_connfd)
-        web_send(web_connfd, buffer);
+        web_append(buffer, len);
+}
+
+void report(int level, char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    vreport(level, true, fmt, ap);
+    va_end(ap);
+}
+
+void report_noreturn(int level, char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    vreport(level, false, fmt, ap);
+    va_end(ap);
+}
+
+void report_flush()
+{
+    if (verbfile)
+        fflush(verbfile);
+    if (jsonfile)
+        fflush(jsonfile);
+    web_flush();
 }
 
 /* Functions denoting failures */
@@ -166,20 +341,20 @@ static void fail_fun(char *format, char *msg)
     snprintf(fail_buf, sizeof(fail_buf), format, msg);
     /* Tack on return */
     fail_buf[strlen(fail_buf)] = '\n';
-    /* Use write to avoid any buffering issues */
+    /* Use write to avoid any buffering issues, after emitting whatever is
+     * still pending so that output stays in order.
+     */
+    if (verbfile)
+        fflush(verbfile);
     ret = write(STDOUT_FILENO, fail_buf, strlen(fail_buf) + 1);
 
-    if (logfile) {
-        /* Don't know file descriptor for logfile */
-        fputs(fail_buf, logfile);
-    }
+    if (log_fd >= 0)
+        log_write(fail_buf, strlen(fail_buf));
 
     if (fatal_fun)
         fatal_fun();
 
-    if (logfile)
-        fclose(logfile);
-
+    log_flush();
     exit(1);
 }
 
@@ -313,3 +488,83 @@ double delta_time(double *timep)
     *timep = current_time;
     return delta;
 }
+
+int64_t monotonic_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Structured output.
+ * Every top-level command produces one JSON object on its own line.
+ */
+
+/* Counters at the time the current command started */
+static int64_t json_start_ns;
+static size_t json_allocate_cnt, json_allocate_bytes, json_free_cnt;
+static size_t json_block_cnt, json_block_bytes;
+
+bool set_jsonfile(char *file_name)
+{
+    if (jsonfile && jsonfile != stdout)
+        fclose(jsonfile);
+    jsonfile = strcmp(file_name, "-") ? fopen(file_name, "w") : stdout;
+    return jsonfile != NULL;
+}
+
+static void json_puts(char *s)
+{
+    fputc('"', jsonfile);
+    for (unsigned char c; (c = *s); s++) {
+        if (c == '"' || c == '\\')
+            fprintf(jsonfile, "\\%c", c);
+        else if (c < 0x20)
+            fprintf(jsonfile, "\\u%04x", c);
+        else
+            fputc(c, jsonfile);
+    }
+    fputc('"', jsonfile);
+}
+
+void json_cmd_begin()
+{
+    if (!jsonfile)
+        return;
+
+    json_allocate_cnt = allocate_cnt;
+    json_allocate_bytes = allocate_bytes;
+    json_free_cnt = free_cnt;
+    last_peak_bytes = current_bytes;
+    allocation_totals(&json_block_cnt, &json_block_bytes);
+    json_start_ns = monotonic_ns();
+}
+
+void json_cmd_end(int argc, char *argv[], bool ok)
+{
+    if (!jsonfile)
+        return;
+
+    int64_t elapsed = monotonic_ns() - json_start_ns;
+    size_t block_cnt, block_bytes;
+    allocation_totals(&block_cnt, &block_bytes);
+
+    fprintf(jsonfile, "{\"cmd\":");
+    json_puts(argv[0]);
+    fprintf(jsonfile, ",\"args\":[");
+    for (int i = 1; i < argc; i++) {
+        if (i > 1)
+            fputc(',', jsonfile);
+        json_puts(argv[i]);
+    }
+    fprintf(jsonfile,
+            "],\"ok\":%s,\"elapsed_ns\":%ld,\"allocs\":%lu,"
+            "\"alloc_bytes\":%lu,\"frees\":%lu,\"peak_bytes\":%lu,"
+            "\"total_peak_bytes\":%lu,\"blocks\":%lu,"
+            "\"block_allocs\":%lu,\"block_bytes\":%lu}\n",
+            ok ? "true" : "false", (long) elapsed,
+            allocate_cnt - json_allocate_cnt,
+            allocate_bytes - json_allocate_bytes, free_cnt - json_free_cnt,
+            last_peak_bytes, peak_bytes, allocation_check(),
+            block_cnt - json_block_cnt, block_bytes - json_block_bytes);
+}
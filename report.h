@@ -3,6 +3,7 @@
 
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 /* Ways to report interesting behavior and errors */
 
@@ -26,6 +27,11 @@ void report(int verblevel, char *fmt, ...);
 /* Like report, but without return character */
 void report_noreturn(int verblevel, char *fmt, ...);
 
+/* Output of report and report_noreturn is buffered.  Push it out to the
+ * console, log file and web client.  Called once per command.
+ */
+void report_flush();
+
 /* Attempt to call malloc.  Fail when returns NULL */
 void *malloc_or_fail(size_t bytes, char *fun_name);
 
@@ -50,4 +56,17 @@ void init_time(double *timep);
 /* Compute time since last call with this timer and reset timer */
 double delta_time(double *timep);
 
+/* Monotonic clock in nanoseconds */
+int64_t monotonic_ns();
+
+/* Structured output: one JSON line per top-level command, carrying its
+ * arguments, status, elapsed time and allocation counters.
+ * File name "-" selects standard output.
+ */
+bool set_jsonfile(char *file_name);
+
+/* Bracket the execution of a command.  No effect unless a JSON file is set */
+void json_cmd_begin();
+void json_cmd_end(int argc, char *argv[], bool ok);
+
 #endif /* LAB0_REPORT_H */
@@ -4,6 +4,10 @@ from __future__ import print_function
 import subprocess
 import sys
 import getopt
+import json
+import os
+import tempfile
+import time
 
 
 
@@ -60,6 +64,11 @@ class Tracer:
 
     maxScores = [0, 5, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 5]
 
+    # Performance metrics recorded per trace, compared against a baseline
+    metrics = ["wall_s", "peak_bytes", "allocs", "block_allocs", "block_bytes"]
+    # Wall time changes smaller than this are treated as noise
+    minWallDelta = 0.05
+
     RED = '\033[91m'
     GREEN = '\033[92m'
     WHITE = '\033[0m'
@@ -69,13 +78,21 @@ class Tracer:
                  verbLevel=0,
                  autograde=False,
                  useValgrind=False,
-                 colored=False):
+                 colored=False,
+                 resultFile="",
+                 baselineFile="",
+                 threshold=20.0):
         if qtest != "":
             self.qtest = qtest
         self.verbLevel = verbLevel
         self.autograde = autograde
         self.useValgrind = useValgrind
         self.colored = colored
+        self.resultFile = resultFile
+        self.baselineFile = baselineFile
+        self.threshold = threshold
+        self.measure = resultFile != "" or baselineFile != ""
+        self.results = {}
 
     def printInColor(self, text, color):
         if self.colored == False:
@@ -89,14 +106,69 @@ class Tracer:
         fname = "%s/%s.cmd" % (self.traceDirectory, self.traceDict[tid])
         vname = "%d" % self.verbLevel
         clist = self.command + ["-v", vname, "-f", fname]
+        if self.measure:
+            (fd, jname) = tempfile.mkstemp(prefix="qtest.", suffix=".json")
+            os.close(fd)
+            clist += ["-j", jname]
 
         try:
+            start = time.time()
             retcode = subprocess.call(clist)
+            wall = time.time() - start
         except Exception as e:
             self.printInColor("Call of '%s' failed: %s" % (" ".join(clist), e), self.RED)
             return False
+        if self.measure:
+            self.results[self.traceDict[tid]] = self.collect(jname, wall)
+            os.remove(jname)
         return retcode == 0
 
+    # Summarize the JSON lines written by qtest for one trace
+    def collect(self, jname, wall):
+        result = {m: 0 for m in self.metrics}
+        result["wall_s"] = round(wall, 4)
+        with open(jname) as f:
+            for line in f:
+                try:
+                    rec = json.loads(line)
+                except ValueError:
+                    continue
+                result["peak_bytes"] = max(result["peak_bytes"],
+                                           rec.get("total_peak_bytes", 0))
+                for m in ["allocs", "block_allocs", "block_bytes"]:
+                    result[m] += rec.get(m, 0)
+        return result
+
+    # Report traces that got worse than the baseline by more than threshold
+    # percent.  Returns the number of regressions.
+    def compare(self):
+        try:
+            with open(self.baselineFile) as f:
+                baseline = json.load(f)
+        except (IOError, ValueError) as e:
+            self.printInColor("ERROR: Cannot read baseline '%s': %s" %
+                              (self.baselineFile, e), self.RED)
+            return 1
+        regressions = 0
+        limit = 1 + self.threshold / 100.0
+        for (tname, result) in self.results.items():
+            if not tname in baseline:
+                continue
+            for m in self.metrics:
+                old = baseline[tname].get(m, 0)
+                new = result[m]
+                if new <= old * limit:
+                    continue
+                if m == "wall_s" and new - old < self.minWallDelta:
+                    continue
+                regressions += 1
+                self.printInColor("---\t%s\t%s %s -> %s" % (tname, m, old, new),
+                                  self.RED)
+        if regressions:
+            self.printInColor("---\t%d performance regression(s) over %g%%" %
+                              (regressions, self.threshold), self.RED)
+        return regressions
+
     def run(self, tid=0):
         scoreDict = {k: 0 for k in self.traceDict.keys()}
         print("---\tTrace\t\tPoints")
@@ -142,16 +214,25 @@ class Tracer:
                 jstring += '"%s" : %d' % (self.traceProbs[k], scoreDict[k])
             jstring += '}}'
             print(jstring)
-        if score < maxscore:
+        if self.resultFile != "":
+            with open(self.resultFile, "w") as f:
+                json.dump(self.results, f, indent=2, sort_keys=True)
+                f.write("\n")
+        regressions = self.compare() if self.baselineFile != "" else 0
+        if score < maxscore or regressions:
             sys.exit(1)
 
 def usage(name):
     print("Usage: %s [-h] [-p PROG] [-t TID] [-v VLEVEL] [--valgrind] [-c]" % name)
+    print("       [-r RFILE] [-b BFILE] [--threshold PCT]")
     print("  -h        Print this message")
     print("  -p PROG   Program to test")
     print("  -t TID    Trace ID to test")
     print("  -v VLEVEL Set verbosity level (0-3)")
     print("  -c Enable colored text")
+    print("  -r RFILE  Save wall time, peak memory and allocations per trace")
+    print("  -b BFILE  Fail on traces doing worse than results saved in BFILE")
+    print("  --threshold PCT  Tolerated increase over baseline (default 20)")
     sys.exit(0)
 
 
@@ -163,8 +244,12 @@ def run(name, args):
     autograde = False
     useValgrind = False
     colored = False
+    resultFile = ""
+    baselineFile = ""
+    threshold = 20.0
 
-    optlist, args = getopt.getopt(args, 'hp:t:v:A:c', ['valgrind'])
+    optlist, args = getopt.getopt(args, 'hp:t:v:A:cr:b:',
+                                  ['valgrind', 'threshold='])
     for (opt, val) in optlist:
         if opt == '-h':
             usage(name)
@@ -181,6 +266,12 @@ def run(name, args):
             useValgrind = True
         elif opt == '-c':
             colored = True
+        elif opt == '-r':
+            resultFile = val
+        elif opt == '-b':
+            baselineFile = val
+        elif opt == '--threshold':
+            threshold = float(val)
         else:
             print("Unrecognized option '%s'" % opt)
             usage(name)
@@ -190,7 +281,10 @@ def run(name, args):
                verbLevel=vlevel,
                autograde=autograde,
                useValgrind=useValgrind,
-               colored=colored)
+               colored=colored,
+               resultFile=resultFile,
+               baselineFile=baselineFile,
+               threshold=threshold)
     t.run(tid)
 
 
@@ -8,9 +8,17 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h> /* strncasecmp */
 #include <sys/socket.h>
 #include <unistd.h>
 
+#if defined(__linux__)
+#include <fcntl.h>
+#include <sys/epoll.h>
+#endif
+
+#include "web.h"
+
 #define LISTENQ 1024 /* second argument to listen() */
 #define MAXLINE 1024 /* max length of a line */
 #define BUFSIZE 1024
@@ -116,9 +124,19 @@ static ssize_t rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen)
     return n;
 }
 
+/* Connection of the event loop whose request is being served.  Its output
+ * is buffered, to be sent without blocking.
+ */
+static int serving_fd = -1;
+
+static void conn_output(const char *buf, size_t len);
+
 void web_send(int out_fd, char *buf)
 {
-    writen(out_fd, buf, strlen(buf));
+    if (out_fd == serving_fd)
+        conn_output(buf, strlen(buf));
+    else
+        writen(out_fd, buf, strlen(buf));
 }
 
 int web_open(int port)
@@ -172,6 +190,37 @@ static void url_decode(char *src, char *dest, int max)
     *dest = '\0';
 }
 
+/* Turn the path of uri into a command line: drop the leading '/' and any
+ * query, decode it, and separate arguments by '/'.  Modifies uri.
+ */
+static void uri_to_command(char *uri, char *cmd, int max)
+{
+    char *filename = uri;
+    if (uri[0] == '/') {
+        filename = uri + 1;
+        int length = strlen(filename);
+        if (length == 0) {
+            filename = ".";
+        } else {
+            for (int i = 0; i < length; ++i) {
+                if (filename[i] == '?') {
+                    filename[i] = '\0';
+                    break;
+                }
+            }
+        }
+    }
+    url_decode(filename, cmd, max);
+
+    /* Change '/' to ' ' */
+    char *p = cmd;
+    while (*p) {
+        ++p;
+        if (*p == '/')
+            *p = ' ';
+    }
+}
+
 static void parse_request(int fd, http_request_t *req)
 {
     rio_t rio;
@@ -193,22 +242,7 @@ static void parse_request(int fd, http_request_t *req)
                 req->end++;
         }
     }
-    char *filename = uri;
-    if (uri[0] == '/') {
-        filename = uri + 1;
-        int length = strlen(filename);
-        if (length == 0) {
-            filename = ".";
-        } else {
-            for (int i = 0; i < length; ++i) {
-                if (filename[i] == '?') {
-                    filename[i] = '\0';
-                    break;
-                }
-            }
-        }
-    }
-    url_decode(filename, req->filename, MAXLINE);
+    uri_to_command(uri, req->filename, sizeof(req->filename));
 }
 
 char *web_recv(int fd, struct sockaddr_in *clientaddr)
@@ -216,15 +250,508 @@ char *web_recv(int fd, struct sockaddr_in *clientaddr)
     http_request_t req;
     parse_request(fd, &req);
 
-    char *p = req.filename;
-    /* Change '/' to ' ' */
-    while (*p) {
-        ++p;
-        if (*p == '/')
-            *p = ' ';
-    }
     char *ret = malloc(strlen(req.filename) + 1);
     strncpy(ret, req.filename, strlen(req.filename) + 1);
 
     return ret;
 }
+
+#if defined(__linux__)
+
+#define MAX_EVENTS 64
+
+/* Largest request head accepted, to bound the memory of a connection */
+#define MAX_HEAD 65536
+
+/* Largest body of a batch of commands sent with POST */
+#define MAX_BODY (16 * 1024 * 1024)
+
+/* Most bytes buffered for a connection, enough for any accepted request */
+#define MAX_CONN_BUF (MAX_HEAD + MAX_BODY)
+
+/* Unsent response bytes above which requests wait to be served */
+#define MAX_OUT (1024 * 1024)
+
+/* Output of a command sent before it completes, to stream long batches */
+#define OUT_FLUSH (64 * 1024)
+
+/* Requests of a connection served in a row, before others get a turn */
+#define MAX_SERVE 64
+
+/* Client connection of the event-driven server */
+typedef struct {
+    int fd;
+    char *buf;       /* Received bytes not handled yet */
+    size_t len;      /* Number of bytes in buf */
+    size_t size;     /* Capacity of buf */
+    char *out;       /* Response bytes not sent yet */
+    size_t out_len;  /* Number of bytes in out */
+    size_t out_size; /* Capacity of out */
+    uint32_t events; /* Events watched by epoll */
+    bool chunked;    /* Output being served is sent in chunks */
+    bool held;       /* Output being served waits for its length */
+    bool eof;        /* Client has finished sending */
+    bool backlog;    /* Complete requests are waiting for their turn */
+    bool done;       /* No more requests are served; close once sent */
+    bool failed;     /* Connection is broken or out of memory */
+} web_conn_t;
+
+/* Data of the listening socket in the epoll set */
+static web_conn_t listener;
+
+/* Connection whose request is being served */
+static web_conn_t *serving;
+
+static void set_cork(int fd, int on)
+{
+    setsockopt(fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+}
+
+static void conn_close(int epfd, web_conn_t *c)
+{
+    epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    free(c->buf);
+    free(c->out);
+    free(c);
+}
+
+/* Queue len bytes of data to be sent to the client */
+static void conn_write(web_conn_t *c, const void *data, size_t len)
+{
+    if (c->failed)
+        return;
+
+    if (c->out_size - c->out_len < len) {
+        size_t size = c->out_size ? c->out_size : BUFSIZE;
+        while (size - c->out_len < len)
+            size *= 2;
+        char *out = realloc(c->out, size);
+        if (!out) {
+            c->failed = true;
+            return;
+        }
+        c->out = out;
+        c->out_size = size;
+    }
+    memcpy(c->out + c->out_len, data, len);
+    c->out_len += len;
+}
+
+/* Send as much queued output as the socket takes without blocking.  A
+ * client gone away marks the connection failed, rather than raising
+ * SIGPIPE.
+ */
+static void conn_flush(web_conn_t *c)
+{
+    size_t sent = 0;
+    while (sent < c->out_len && !c->failed) {
+        ssize_t n = send(c->fd, c->out + sent, c->out_len - sent, MSG_NOSIGNAL);
+        if (n >= 0)
+            sent += n;
+        else if (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK)
+            c->failed = true;
+        else if (errno != EINTR)
+            break;
+    }
+    c->out_len -= sent;
+    memmove(c->out, c->out + sent, c->out_len);
+}
+
+static void conn_output(const char *buf, size_t len)
+{
+    web_conn_t *c = serving;
+
+    /* An empty chunk would end the response */
+    if (!len)
+        return;
+    if (c->chunked) {
+        char size[32];
+        snprintf(size, sizeof(size), "%zx\r\n", len);
+        conn_write(c, size, strlen(size));
+        conn_write(c, buf, len);
+        conn_write(c, "\r\n", 2);
+    } else {
+        conn_write(c, buf, len);
+    }
+    if (c->out_len >= OUT_FLUSH && !c->held)
+        conn_flush(c);
+}
+
+/* Read what the client has sent so far.  Return 1 while the client may
+ * send more, 0 once it has finished sending, or -1 if the connection is
+ * broken or its request grows too large.
+ */
+static int conn_read(web_conn_t *c)
+{
+    bool eof = false;
+    for (;;) {
+        /* Leave the rest in the socket until buffered requests are served */
+        if (c->len >= MAX_CONN_BUF)
+            break;
+
+        if (c->size - c->len < BUFSIZE) {
+            size_t size = c->size ? 2 * c->size : 2 * BUFSIZE;
+            if (size > MAX_CONN_BUF + 1)
+                size = MAX_CONN_BUF + 1;
+            char *buf = realloc(c->buf, size);
+            if (!buf)
+                return -1;
+            c->buf = buf;
+            c->size = size;
+        }
+
+        ssize_t n = recv(c->fd, c->buf + c->len, c->size - c->len - 1, 0);
+        if (n > 0) {
+            c->len += n;
+            continue;
+        }
+        if (n == 0) {
+            /* Requests received before the end are still answered */
+            eof = true;
+            break;
+        }
+        if (errno == EINTR)
+            continue;
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+            return -1;
+        break;
+    }
+    c->buf[c->len] = '\0';
+    if (c->len >= MAX_HEAD && !strstr(c->buf, "\r\n\r\n"))
+        return -1;
+    return eof ? 0 : 1;
+}
+
+/* Case-insensitive check that header line starts with name */
+static bool is_header(const char *line, const char *name)
+{
+    return !strncasecmp(line, name, strlen(name));
+}
+
+/* Request parsed by the event-driven server */
+typedef struct {
+    char cmd[MAXLINE];
+    char *body;      /* Commands of a POST, one per line, or NULL */
+    size_t body_len; /* Length of body */
+    bool http11; /* Client speaks HTTP/1.1, and so chunked encoding */
+    bool keep_alive;
+    int status; /* HTTP error to answer with, or 0 */
+} web_req_t;
+
+/* Parse the request at the start of the buffer of c, if it has fully
+ * arrived.  Return the number of bytes it takes, or 0 if incomplete.
+ */
+static size_t parse_head(web_conn_t *c, web_req_t *req)
+{
+    char *end = strstr(c->buf, "\r\n\r\n");
+    if (!end)
+        return 0;
+    size_t head_len = end + 4 - c->buf;
+    *end = '\0';
+
+    char method[MAXLINE], uri[MAXLINE], version[MAXLINE] = "HTTP/1.0";
+    int fields = sscanf(c->buf, "%1023s %1023s %1023s", method, uri, version);
+    bool post = fields >= 1 && !strcmp(method, "POST");
+
+    /* HTTP/1.1 keeps connections open unless asked otherwise */
+    req->http11 = !strcmp(version, "HTTP/1.1");
+    req->keep_alive = req->http11;
+    req->status = 0;
+    if (fields < 2)
+        req->status = 400;
+    else if (!post && strcmp(method, "GET"))
+        req->status = 405;
+    size_t body_len = 0;
+    bool has_length = false;
+    for (char *line = strstr(c->buf, "\r\n"); line; line = strstr(line, "\r\n")) {
+        line += 2;
+        if (is_header(line, "Connection:")) {
+            char *value = line + strlen("Connection:");
+            while (*value == ' ')
+                value++;
+            if (is_header(value, "close"))
+                req->keep_alive = false;
+            else if (is_header(value, "keep-alive"))
+                req->keep_alive = true;
+        } else if (is_header(line, "Content-Length:")) {
+            body_len = strtoul(line + strlen("Content-Length:"), NULL, 10);
+            has_length = true;
+        } else if (is_header(line, "Transfer-Encoding:")) {
+            /* Only bodies of known length are accepted */
+            req->status = 411;
+        }
+    }
+    *end = '\r';
+
+    /* Otherwise the body would be taken for the next request */
+    if (post && !has_length && !req->status)
+        req->status = 411;
+    if (body_len > MAX_BODY)
+        req->status = 413;
+    if (req->status) {
+        req->keep_alive = false;
+        return head_len;
+    }
+
+    /* Wait for the whole body */
+    if (c->len < head_len + body_len)
+        return 0;
+
+    if (post) {
+        req->body = c->buf + head_len;
+        req->body_len = body_len;
+    } else {
+        req->body = NULL;
+        req->body_len = 0;
+        uri_to_command(uri, req->cmd, sizeof(req->cmd));
+    }
+    return head_len + body_len;
+}
+
+/* Run every line of the body of a POST as a command, in order */
+static void serve_batch(int fd, web_req_t *req, web_serve_func_t serve)
+{
+    char *line = req->body;
+    char *end = req->body + req->body_len;
+    while (line < end) {
+        char *eol = memchr(line, '\n', end - line);
+        if (!eol)
+            eol = end;
+        char *next = eol + 1;
+
+        /* Split lines in place; the last may end where the next request
+         * starts, so the byte overwritten is restored.
+         */
+        if (eol > line && eol[-1] == '\r')
+            eol--;
+        char saved = *eol;
+        *eol = '\0';
+        if (*line)
+            serve(fd, line);
+        *eol = saved;
+        line = next;
+    }
+}
+
+static void send_error(web_conn_t *c, int status)
+{
+    char *reason;
+    switch (status) {
+    case 400:
+        reason = "Bad Request";
+        break;
+    case 405:
+        reason = "Method Not Allowed\r\nAllow: GET, POST";
+        break;
+    case 411:
+        reason = "Length Required";
+        break;
+    default:
+        reason = "Payload Too Large";
+        break;
+    }
+
+    char header[MAXLINE];
+    snprintf(header, sizeof(header),
+             "HTTP/1.1 %d %s\r\nContent-Length: 0\r\n"
+             "Connection: close\r\n\r\n",
+             status, reason);
+    conn_write(c, header, strlen(header));
+}
+
+/* Put the header of a response with known length before its body, which
+ * was queued from offset start.
+ */
+static void conn_prepend_length(web_conn_t *c, size_t start)
+{
+    char header[MAXLINE];
+    size_t body_len = c->out_len - start;
+    int len = snprintf(header, sizeof(header),
+                       "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\n"
+                       "Content-Length: %zu\r\nConnection: keep-alive\r\n\r\n",
+                       body_len);
+    conn_write(c, header, len);
+    if (c->failed)
+        return;
+    memmove(c->out + start + len, c->out + start, body_len);
+    memcpy(c->out + start, header, len);
+}
+
+/* Answer the complete requests received on c, in order, until its client
+ * falls behind reading the responses or its turn is over.  Return true if
+ * no complete request is left.
+ */
+static bool conn_serve(web_conn_t *c, web_serve_func_t serve)
+{
+    web_req_t req;
+    size_t used;
+
+    for (int i = 0; !c->done && !c->failed; i++) {
+        if (c->out_len >= MAX_OUT || i == MAX_SERVE)
+            return false;
+        if (!(used = parse_head(c, &req)))
+            break;
+
+        c->done = !req.keep_alive;
+        if (req.status) {
+            send_error(c, req.status);
+            break;
+        }
+
+        /* HTTP/1.0 has no chunks, so output kept alive is sent once its
+         * length is known.
+         */
+        char *header = NULL;
+        if (!req.keep_alive) {
+            header =
+                "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\n"
+                "Connection: close\r\n\r\n";
+        } else if (req.http11) {
+            header =
+                "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\n"
+                "Transfer-Encoding: chunked\r\n\r\n";
+        }
+        if (header)
+            conn_write(c, header, strlen(header));
+        size_t start = c->out_len;
+
+        c->chunked = req.keep_alive && req.http11;
+        c->held = !header;
+        serving = c;
+        serving_fd = c->fd;
+        if (req.body)
+            serve_batch(c->fd, &req, serve);
+        else
+            serve(c->fd, req.cmd);
+        serving_fd = -1;
+        serving = NULL;
+        if (c->chunked)
+            conn_write(c, "0\r\n\r\n", 5);
+        if (c->held)
+            conn_prepend_length(c, start);
+        c->chunked = false;
+        c->held = false;
+
+        c->len -= used;
+        memmove(c->buf, c->buf + used, c->len + 1);
+    }
+    return true;
+}
+
+/* Read, serve and send what connection c is ready for */
+static void conn_handle(web_conn_t *c, uint32_t events, web_serve_func_t serve)
+{
+    if (events & EPOLLERR) {
+        c->failed = true;
+        return;
+    }
+
+    if (!c->eof && !c->done && c->out_len < MAX_OUT) {
+        int open = conn_read(c);
+        if (open < 0) {
+            c->failed = true;
+            return;
+        }
+        c->eof = !open;
+    }
+    conn_flush(c);
+
+    /* Requests wait while the client is not reading the responses */
+    if (!c->done && c->out_len < MAX_OUT) {
+        c->backlog = !conn_serve(c, serve);
+        if (!c->backlog) {
+            /* What is left is an incomplete request */
+            if (c->eof)
+                c->done = true;
+            else if (c->len >= MAX_CONN_BUF)
+                c->failed = true;
+        }
+        conn_flush(c);
+    }
+}
+
+/* Watch c for what it waits on.  Return false if it is to be closed. */
+static bool conn_watch(int epfd, web_conn_t *c)
+{
+    if (c->failed || (c->done && !c->out_len))
+        return false;
+
+    uint32_t events = 0;
+    if (!c->eof && !c->done && c->out_len < MAX_OUT)
+        events |= EPOLLIN;
+    /* A writable socket brings the connection back for its backlog */
+    if (c->out_len || c->backlog)
+        events |= EPOLLOUT;
+    if (events != c->events) {
+        struct epoll_event ev = {.events = events, .data.ptr = c};
+        if (epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev) < 0)
+            return false;
+        c->events = events;
+    }
+    return true;
+}
+
+int web_event_open(int listenfd)
+{
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0)
+        return -1;
+
+    fcntl(listenfd, F_SETFL, fcntl(listenfd, F_GETFL) | O_NONBLOCK);
+    listener.fd = listenfd;
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = &listener};
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, listenfd, &ev) < 0) {
+        close(epfd);
+        return -1;
+    }
+    return epfd;
+}
+
+void web_event_process(int epfd, web_serve_func_t serve)
+{
+    struct epoll_event events[MAX_EVENTS];
+    int n = epoll_wait(epfd, events, MAX_EVENTS, 0);
+    for (int i = 0; i < n; i++) {
+        web_conn_t *c = events[i].data.ptr;
+        if (c != &listener) {
+            conn_handle(c, events[i].events, serve);
+            if (!conn_watch(epfd, c))
+                conn_close(epfd, c);
+            continue;
+        }
+
+        /* Accept every pending connection.  The console must never block
+         * on a client, so connections do not either.
+         */
+        int connfd;
+        while ((connfd = accept(listener.fd, NULL, NULL)) >= 0) {
+            fcntl(connfd, F_SETFL, fcntl(connfd, F_GETFL) | O_NONBLOCK);
+            web_conn_t *conn = calloc(1, sizeof(web_conn_t));
+            struct epoll_event ev = {.events = EPOLLIN, .data.ptr = conn};
+            if (!conn || epoll_ctl(epfd, EPOLL_CTL_ADD, connfd, &ev) < 0) {
+                free(conn);
+                close(connfd);
+                continue;
+            }
+            conn->fd = connfd;
+            conn->events = EPOLLIN;
+
+            /* Responses go out whole, so nothing is held back */
+            set_cork(connfd, 0);
+        }
+    }
+}
+
+#else /* !defined(__linux__) */
+
+int web_event_open(int listenfd)
+{
+    return -1;
+}
+
+void web_event_process(int epfd, web_serve_func_t serve) {}
+
+static void conn_output(const char *buf, size_t len) {}
+
+#endif /* defined(__linux__) */
@@ -2,6 +2,7 @@
 #define TINYWEB_H
 
 #include <netinet/in.h>
+#include <stdbool.h>
 
 int web_open(int port);
 
@@ -9,4 +10,20 @@ char *web_recv(int fd, struct sockaddr_in *clientaddr);
 
 void web_send(int out_fd, char *buffer);
 
+/* Run the command requested on connection fd, sending output to it */
+typedef void (*web_serve_func_t)(int fd, char *cmdline);
+
+/* Serve the connections of listenfd from an event loop.  Return a
+ * descriptor that becomes readable when web_event_process() has work, or
+ * -1 if connections have to be accepted one at a time with web_recv().
+ */
+int web_event_open(int listenfd);
+
+/* Handle ready connections without blocking.  Connections are kept open
+ * between requests, and pipelined requests are answered in order.  A GET
+ * runs the command named by its path; a POST runs each line of its body
+ * as a command, streaming the output back.
+ */
+void web_event_process(int epfd, web_serve_func_t serve);
+
 #endif
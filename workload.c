@@ -0,0 +1,416 @@
+/* Generate reproducible mixed workloads as qtest command files.
+ *
+ * The generator keeps a model of the queue, so removals are only issued on
+ * a non-empty queue and may be checked against the expected string.  Keys
+ * are zero-padded numbers, so that string order matches numeric order.
+ */
+
+#include <getopt.h>
+#include <limits.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_SIZE 100000000
+#define KEY_FMT "k%010u"
+
+typedef enum { OP_IH, OP_IT, OP_RH, OP_RT, OP_SORT, OP_MERGE, OP_DEDUP } op_t;
+
+#define NOPS (OP_DEDUP + 1)
+static const char *op_names[NOPS] = {"ih",   "it",    "rh",   "rt",
+                                     "sort", "merge", "dedup"};
+static unsigned op_weight[NOPS] = {30, 30, 20, 20, 0, 0, 0};
+
+typedef enum {
+    DIST_UNIFORM,
+    DIST_ZIPF,
+    DIST_SORTED,
+    DIST_REVERSE,
+    DIST_FEW,
+} dist_t;
+
+#define NDISTS (DIST_FEW + 1)
+static const char *dist_names[NDISTS] = {"uniform", "zipf", "sorted",
+                                         "reverse", "few"};
+
+/* Generator settings */
+static uint64_t seed = 1;
+static long nops = 1000;
+static long init_size = 0;
+static long merge_len = 16;
+static long nkeys = 0;
+static dist_t dist = DIST_UNIFORM;
+static double zipf_s = 1.0;
+static bool expect = false;
+
+/* splitmix64, so that output depends on nothing but the seed */
+static uint64_t rng_state;
+
+static uint64_t rng_next()
+{
+    uint64_t z = (rng_state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+/* Uniform double in [0, 1) */
+static double rng_double()
+{
+    return (rng_next() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/* Next key from the configured distribution */
+static uint32_t next_key()
+{
+    static uint32_t counter = 0;
+
+    switch (dist) {
+    case DIST_SORTED:
+        return counter++;
+    case DIST_REVERSE:
+        return UINT32_MAX - counter++;
+    case DIST_ZIPF: {
+        /* Inverse of the continuous Zipf CDF over ranks 1..nkeys.  Ranks
+         * are scattered over the key space so that popular keys are not
+         * also the smallest ones.
+         */
+        double u = rng_double(), n = nkeys, rank;
+        if (fabs(zipf_s - 1.0) < 1e-9)
+            rank = pow(n, u);
+        else
+            rank = pow((pow(n, 1 - zipf_s) - 1) * u + 1, 1 / (1 - zipf_s));
+        uint64_t r = (uint64_t) rank - 1;
+        if (r >= (uint64_t) nkeys)
+            r = nkeys - 1;
+        return (uint32_t) ((r * 2654435761ULL) % (uint64_t) nkeys);
+    }
+    default:
+        return rng_next() % (uint64_t) nkeys;
+    }
+}
+
+/* Model of the queue as a growable ring of keys */
+static struct {
+    uint32_t *buf;
+    size_t mask; /* Capacity - 1, capacity is a power of 2 */
+    size_t head;
+    size_t size;
+} q;
+
+static void q_reserve(size_t need)
+{
+    size_t cap = q.buf ? q.mask + 1 : 0;
+    if (need <= cap)
+        return;
+
+    size_t ncap = cap ? cap : 1024;
+    while (ncap < need)
+        ncap *= 2;
+    uint32_t *nbuf = malloc(ncap * sizeof(uint32_t));
+    if (!nbuf) {
+        fprintf(stderr, "Out of memory for %zu keys\n", need);
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < q.size; i++)
+        nbuf[i] = q.buf[(q.head + i) & q.mask];
+    free(q.buf);
+    q.buf = nbuf;
+    q.mask = ncap - 1;
+    q.head = 0;
+}
+
+static void q_push_head(uint32_t key)
+{
+    q_reserve(q.size + 1);
+    q.head = (q.head - 1) & q.mask;
+    q.buf[q.head] = key;
+    q.size++;
+}
+
+static void q_push_tail(uint32_t key)
+{
+    q_reserve(q.size + 1);
+    q.buf[(q.head + q.size++) & q.mask] = key;
+}
+
+static uint32_t q_pop_head()
+{
+    uint32_t key = q.buf[q.head];
+    q.head = (q.head + 1) & q.mask;
+    q.size--;
+    return key;
+}
+
+static uint32_t q_pop_tail()
+{
+    return q.buf[(q.head + --q.size) & q.mask];
+}
+
+static int cmp_key(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+    return (x > y) - (x < y);
+}
+
+/* Make the model contiguous and sorted */
+static void q_sort_model()
+{
+    size_t cap = q.mask + 1;
+    if (q.head + q.size > cap) {
+        uint32_t *nbuf = malloc(cap * sizeof(uint32_t));
+        if (!nbuf) {
+            fprintf(stderr, "Out of memory for %zu keys\n", cap);
+            exit(EXIT_FAILURE);
+        }
+        for (size_t i = 0; i < q.size; i++)
+            nbuf[i] = q.buf[(q.head + i) & q.mask];
+        free(q.buf);
+        q.buf = nbuf;
+    } else if (q.head) {
+        memmove(q.buf, q.buf + q.head, q.size * sizeof(uint32_t));
+    }
+    q.head = 0;
+    qsort(q.buf, q.size, sizeof(uint32_t), cmp_key);
+}
+
+/* Drop every key occurring more than once, as q_delete_dup does */
+static void q_dedup_model()
+{
+    size_t out = 0;
+    for (size_t i = 0; i < q.size;) {
+        size_t j = i + 1;
+        while (j < q.size && q.buf[j] == q.buf[i])
+            j++;
+        if (j == i + 1)
+            q.buf[out++] = q.buf[i];
+        i = j;
+    }
+    q.size = out;
+}
+
+static void emit_insert(op_t op, uint32_t key)
+{
+    printf("%s " KEY_FMT "\n", op_names[op], key);
+    if (op == OP_IH)
+        q_push_head(key);
+    else
+        q_push_tail(key);
+}
+
+static void emit_remove(op_t op)
+{
+    uint32_t key = op == OP_RH ? q_pop_head() : q_pop_tail();
+    if (expect)
+        printf("%s " KEY_FMT "\n", op_names[op], key);
+    else
+        printf("%s\n", op_names[op]);
+}
+
+/* Merge a freshly built sorted queue into the current one */
+static void emit_merge()
+{
+    printf("sort\nnew\n");
+    uint32_t *keys = malloc(merge_len * sizeof(uint32_t));
+    if (!keys) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    for (long i = 0; i < merge_len; i++)
+        keys[i] = next_key();
+    qsort(keys, merge_len, sizeof(uint32_t), cmp_key);
+    for (long i = 0; i < merge_len; i++) {
+        printf("it " KEY_FMT "\n", keys[i]);
+        q_push_tail(keys[i]);
+    }
+    free(keys);
+    printf("merge\n");
+    q_sort_model();
+}
+
+static op_t pick_op(unsigned total)
+{
+    unsigned r = rng_next() % total;
+    op_t op = OP_IH;
+    while (r >= op_weight[op])
+        r -= op_weight[op++];
+    return op;
+}
+
+static bool parse_mix(char *spec)
+{
+    memset(op_weight, 0, sizeof(op_weight));
+    for (char *tok = strtok(spec, ","); tok; tok = strtok(NULL, ",")) {
+        char *eq = strchr(tok, '=');
+        if (!eq)
+            return false;
+        *eq = '\0';
+        op_t op;
+        for (op = 0; op < NOPS && strcmp(tok, op_names[op]); op++)
+            ;
+        if (op == NOPS)
+            return false;
+        char *end;
+        long w = strtol(eq + 1, &end, 10);
+        if (*end || w < 0 || w > 1000000)
+            return false;
+        op_weight[op] = w;
+    }
+    return true;
+}
+
+static long parse_long(char *arg, char *what, long min, long max)
+{
+    char *end;
+    long v = strtol(arg, &end, 10);
+    if (end == arg || *end || v < min || v > max) {
+        fprintf(stderr, "Invalid %s '%s'\n", what, arg);
+        exit(EXIT_FAILURE);
+    }
+    return v;
+}
+
+static void usage(char *cmd)
+{
+    printf("Usage: %s [-h] [-x] [-s SEED] [-n OPS] [-i SIZE] [-d DIST]\n"
+           "       [-k KEYS] [-z EXP] [-m MIX] [-l LEN]\n",
+           cmd);
+    printf("\t-h         Print this information\n");
+    printf("\t-x         Check removed strings against expected keys\n");
+    printf("\t-s SEED    Random seed (default 1)\n");
+    printf("\t-n OPS     Number of mixed operations (default 1000)\n");
+    printf("\t-i SIZE    Initial queue size, at most %d (default 0)\n",
+           MAX_SIZE);
+    printf("\t-d DIST    Key distribution: uniform, zipf, sorted, reverse, "
+           "few\n");
+    printf("\t-k KEYS    Number of distinct keys (default: SIZE + OPS, "
+           "8 for few)\n");
+    printf("\t-z EXP     Zipf exponent (default 1.0)\n");
+    printf("\t-m MIX     Operation weights, e.g. "
+           "ih=30,it=30,rh=20,rt=20,sort=1,merge=1,dedup=1\n");
+    printf("\t-l LEN     Length of queues merged in (default 16)\n");
+    exit(0);
+}
+
+int main(int argc, char *argv[])
+{
+    int c;
+    while ((c = getopt(argc, argv, "hxs:n:i:d:k:z:m:l:")) != -1) {
+        switch (c) {
+        case 'h':
+            usage(argv[0]);
+            break;
+        case 'x':
+            expect = true;
+            break;
+        case 's':
+            seed = strtoull(optarg, NULL, 0);
+            break;
+        case 'n':
+            nops = parse_long(optarg, "operation count", 0, LONG_MAX);
+            break;
+        case 'i':
+            init_size = parse_long(optarg, "initial size", 0, MAX_SIZE);
+            break;
+        case 'k':
+            nkeys = parse_long(optarg, "key count", 1, UINT32_MAX);
+            break;
+        case 'l':
+            merge_len = parse_long(optarg, "merge length", 1, MAX_SIZE);
+            break;
+        case 'z':
+            zipf_s = atof(optarg);
+            if (zipf_s <= 0) {
+                fprintf(stderr, "Invalid Zipf exponent '%s'\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'd': {
+            int d;
+            for (d = 0; d < NDISTS && strcmp(optarg, dist_names[d]); d++)
+                ;
+            if (d == NDISTS) {
+                fprintf(stderr, "Unknown distribution '%s'\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            dist = d;
+            break;
+        }
+        case 'm':
+            if (!parse_mix(optarg)) {
+                fprintf(stderr, "Invalid operation mix\n");
+                exit(EXIT_FAILURE);
+            }
+            break;
+        default:
+            printf("Unknown option '%c'\n", c);
+            usage(argv[0]);
+            break;
+        }
+    }
+
+    unsigned total = 0;
+    for (int op = 0; op < NOPS; op++)
+        total += op_weight[op];
+    if (nops && !total) {
+        fprintf(stderr, "Operation mix has no weight\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (!nkeys) {
+        nkeys = dist == DIST_FEW ? 8 : init_size + nops;
+        if (nkeys < 1)
+            nkeys = 1;
+        if (nkeys > UINT32_MAX)
+            nkeys = UINT32_MAX;
+    }
+    rng_state = seed;
+
+    static char obuf[1 << 16];
+    setvbuf(stdout, obuf, _IOFBF, sizeof(obuf));
+
+    printf("# Workload: seed %llu, %ld ops, initial size %ld, %s keys\n",
+           (unsigned long long) seed, nops, init_size, dist_names[dist]);
+    printf("option fail 0\noption malloc 0\nnew\n");
+
+    q_reserve(init_size + 1);
+    for (long i = 0; i < init_size; i++)
+        emit_insert(OP_IT, next_key());
+
+    for (long i = 0; i < nops; i++) {
+        op_t op = pick_op(total);
+        /* Removing from an empty queue is an error; insert instead */
+        if ((op == OP_RH || op == OP_RT) && !q.size)
+            op = op == OP_RH ? OP_IH : OP_IT;
+
+        switch (op) {
+        case OP_IH:
+        case OP_IT:
+            emit_insert(op, next_key());
+            break;
+        case OP_RH:
+        case OP_RT:
+            emit_remove(op);
+            break;
+        case OP_SORT:
+            printf("sort\n");
+            q_sort_model();
+            break;
+        case OP_MERGE:
+            emit_merge();
+            break;
+        case OP_DEDUP:
+            printf("sort\ndedup\n");
+            q_sort_model();
+            q_dedup_model();
+            break;
+        }
+    }
+
+    printf("free\n");
+    free(q.buf);
+    return fflush(stdout) ? EXIT_FAILURE : EXIT_SUCCESS;
+}